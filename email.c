@@ -12,23 +12,279 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <regex.h>
 
 #include "fmgr.h"
+#include "funcapi.h"
 #include "libpq/pqformat.h"		/* needed for send/recv functions */
-
-#define MAX_CHARS  128
-#define TRUE 1
-#define FALSE 0
+#include "catalog/pg_type.h"
+#include "utils/array.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/sortsupport.h"
+#include "lib/hyperloglog.h"
+#include "lib/ilist.h"
+#include "access/gin.h"
+#include "commands/vacuum.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/stratnum.h"
+#include "catalog/pg_am.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/supportnodes.h"
+#endif
+#if PG_VERSION_NUM >= 110000
+#include "access/spgist.h"
+#include "catalog/pg_collation.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#endif
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#if PG_VERSION_NUM >= 130000
+#include "catalog/pg_statistic.h"
+#include "utils/selfuncs.h"
+#endif
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "access/hash.h"
+#endif
+
+#include "email_core.h"
 
 PG_MODULE_MAGIC;
 
-typedef struct EmailAddress
+/* GUC: email.trace_parse, log the outcome of every email_in call */
+static bool email_trace_parse = false;
+
+/* GUC: email.fold_case, the EMAIL_FLAG_*_FOLDED bits new values get */
+static int email_fold_case = 0;
+
+/* GUC: email.encode_domains, store dictionary domains as their id */
+static bool email_encode_domains = false;
+
+/* GUC: email.parse_cache_size, entries of the email_in cache, 0 for none */
+static int email_parse_cache_size = 0;
+static void email_cache_size_assign(int newval, void *extra);
+
+/* GUC: email.similarity_threshold, the cut off of the % operator */
+static double email_similarity_threshold = 0.3;
+
+/* GUC: email.track_stats, count calls and failures for email_stats */
+static bool email_track_stats = false;
+
+/*
+ * The usage counters of email_stats.  The failures are in EmailParseStatus
+ * order, so that EMAIL_STAT_PARSES + status counts a failure of that kind.
+ */
+typedef enum EmailStat
+{
+	EMAIL_STAT_PARSES,           // addresses parsed, or answered from the parse cache
+	EMAIL_STAT_NO_LOCAL,
+	EMAIL_STAT_NO_DOMAIN,
+	EMAIL_STAT_INVALID_CHAR,
+	EMAIL_STAT_BAD_LOCAL,
+	EMAIL_STAT_BAD_DOMAIN,
+	EMAIL_STAT_TOO_LONG,
+	EMAIL_STAT_COMPARES,         // calls of email_cmp_internal
+	EMAIL_STAT_BYTES,            // bytes allocated for values and their text
+	EMAIL_NUM_STATS
+}	EmailStat;
+
+/* This backend's counts, and how much of them is in the cluster's yet */
+static uint64 email_stats_local[EMAIL_NUM_STATS];
+static uint64 email_stats_flushed[EMAIL_NUM_STATS];
+static bool email_stats_dirty = false;
+
+/*
+ * Count an event for email_stats.  As with EMAIL_TRACE, the GUC is tested
+ * first, so a disabled counter costs one predictable branch.
+ */
+#define EMAIL_COUNT(stat, n) \
+	do { \
+		if (unlikely(email_track_stats)) { \
+			email_stats_local[stat] += (n); \
+			email_stats_dirty = true; \
+		} \
+	} while (0)
+
+/*
+ * Emit parser trace output at DEBUG2.  The GUC is tested first so that
+ * the arguments are not even evaluated while tracing is off.
+ */
+#define EMAIL_TRACE(...) \
+	do { \
+		if (unlikely(email_trace_parse)) \
+			elog(DEBUG2, __VA_ARGS__); \
+	} while (0)
+
+/*
+ * On-disk layout of an EmailAddress.
+ *
+ * The value is a varlena whose payload is a two byte header followed by
+ * the local bytes and then the domain bytes, with no terminators and no
+ * padding:
+ *
+ *     [flags][local_len][local ...][domain ...]
+ *
+ * The domain length is whatever is left of the payload.  The payload is
+ * only ever read through VARDATA_ANY, so the datum is happy to live with
+ * a short (1-byte) varlena header on disk.
+ *
+ * Depending on email.fold_case a part may be stored lower cased, which
+ * lets two such values be compared with memcmp.  The flags say which parts
+ * are folded.  A folded local part that had upper case letters is followed,
+ * after the domain, by a bitmap of (local_len + 7) / 8 bytes marking them,
+ * so the original spelling can still be printed.  A domain is only marked
+ * folded when it was written in lower case to begin with.  Folding thus
+ * never changes what a value prints as or compares to, only how it is
+ * stored, so the functions reading email.fold_case stay immutable.
+ *
+ * With email.encode_domains on, a lower case domain found in the
+ * email_domains dictionary is stored as a single id byte instead, and is
+ * then treated as folded.  The entries are all lower case, so the id
+ * prints back as the very same name.
+ *
+ * Values written by older versions of this module used a fixed layout of
+ * two zero padded MAX_CHARS arrays (see EmailAddressLegacy).  A valid local
+ * part always starts with a letter, so a first payload byte at or above
+ * EMAIL_FLAGS_LEGACY_MIN identifies the old layout; every flags value of
+ * the packed layout stays below it.
+ */
+typedef struct varlena EmailAddress;
+
+typedef struct EmailHeader
+{
+	uint8		flags;               // layout flags, always < EMAIL_FLAGS_LEGACY_MIN
+	uint8		local_len;           // length of the local part, i.e. domain offset
+}	EmailHeader;
+
+typedef struct EmailAddressLegacy
 {
 	int32		length;              // Variable length data types need this
 	char		local[MAX_CHARS];    // the 'local' string
 	char		domain[MAX_CHARS];   // the 'domain' string
-}	EmailAddress;
+}	EmailAddressLegacy;
+
+#define EMAIL_HDRSZ             ((int) sizeof(EmailHeader))
+
+/* The most an address with parts of these lengths can take, casemap included */
+#define EMAIL_PACKED_MAX(local_len, domain_len) \
+	(VARHDRSZ + EMAIL_HDRSZ + (local_len) + (domain_len) + ((local_len) + 7) / 8)
+#define EMAIL_FLAGS_LEGACY_MIN  0x40
+
+#define EMAIL_FLAG_DOMAIN_FOLDED  0x01   // domain is stored in lower case
+#define EMAIL_FLAG_LOCAL_FOLDED   0x02   // local is stored in lower case
+#define EMAIL_FLAG_LOCAL_CASEMAP  0x04   // a local case bitmap follows the domain
+#define EMAIL_FLAG_DOMAIN_ID      0x08   // domain is one byte email_domains id
+
+/*
+ * The type modifier of an EmailAddress(canonical) column, whose values the
+ * input functions and the length coercion cast store in canonical form.
+ * The parse cache tells such values apart by EMAIL_CACHE_CANONICAL, a bit
+ * above every store bit.
+ */
+#define EMAIL_TYPMOD_CANONICAL    1
+#define EMAIL_CACHE_CANONICAL     0x100
+
+/*
+ * The domain dictionary.  With email.encode_domains on, a lower case
+ * domain found here is stored as its one byte id (index + 1) instead of
+ * its name, so the entries must be lower case too.  The ids are on disk,
+ * so entries must never be changed, removed or moved.
+ * The list is sorted the way parts_memcmp sorts, which makes the order of
+ * ids the order of the domains; adding an entry would break that, and so
+ * needs a new flag bit and a second table.
+ */
+typedef struct EmailDomain
+{
+	const char *name;
+	int			len;
+}	EmailDomain;
+
+#define DICT_DOMAIN(name)  { name, sizeof(name) - 1 }
+
+static const EmailDomain email_domains[] = {
+	DICT_DOMAIN("aol.com"),
+	DICT_DOMAIN("att.net"),
+	DICT_DOMAIN("bigpond.com"),
+	DICT_DOMAIN("bigpond.net.au"),
+	DICT_DOMAIN("btinternet.com"),
+	DICT_DOMAIN("comcast.net"),
+	DICT_DOMAIN("cox.net"),
+	DICT_DOMAIN("earthlink.net"),
+	DICT_DOMAIN("email.com"),
+	DICT_DOMAIN("fastmail.com"),
+	DICT_DOMAIN("free.fr"),
+	DICT_DOMAIN("gmail.com"),
+	DICT_DOMAIN("gmx.com"),
+	DICT_DOMAIN("gmx.de"),
+	DICT_DOMAIN("gmx.net"),
+	DICT_DOMAIN("googlemail.com"),
+	DICT_DOMAIN("hotmail.co.uk"),
+	DICT_DOMAIN("hotmail.com"),
+	DICT_DOMAIN("hotmail.fr"),
+	DICT_DOMAIN("icloud.com"),
+	DICT_DOMAIN("inbox.com"),
+	DICT_DOMAIN("juno.com"),
+	DICT_DOMAIN("live.co.uk"),
+	DICT_DOMAIN("live.com"),
+	DICT_DOMAIN("live.com.au"),
+	DICT_DOMAIN("mac.com"),
+	DICT_DOMAIN("mail.com"),
+	DICT_DOMAIN("mail.ru"),
+	DICT_DOMAIN("me.com"),
+	DICT_DOMAIN("msn.com"),
+	DICT_DOMAIN("optusnet.com.au"),
+	DICT_DOMAIN("orange.fr"),
+	DICT_DOMAIN("outlook.com"),
+	DICT_DOMAIN("proton.me"),
+	DICT_DOMAIN("protonmail.com"),
+	DICT_DOMAIN("qq.com"),
+	DICT_DOMAIN("rocketmail.com"),
+	DICT_DOMAIN("rogers.com"),
+	DICT_DOMAIN("sbcglobal.net"),
+	DICT_DOMAIN("sky.com"),
+	DICT_DOMAIN("t-online.de"),
+	DICT_DOMAIN("telstra.com"),
+	DICT_DOMAIN("verizon.net"),
+	DICT_DOMAIN("web.de"),
+	DICT_DOMAIN("yahoo.ca"),
+	DICT_DOMAIN("yahoo.co.in"),
+	DICT_DOMAIN("yahoo.co.uk"),
+	DICT_DOMAIN("yahoo.com"),
+	DICT_DOMAIN("yahoo.com.au"),
+	DICT_DOMAIN("yahoo.fr"),
+	DICT_DOMAIN("yandex.ru"),
+	DICT_DOMAIN("ymail.com"),
+	DICT_DOMAIN("zoho.com"),
+};
+
+#define EMAIL_NUM_DOMAINS  ((int) lengthof(email_domains))
+
+/*
+ * The unpacked view of an EmailAddress.  The strings point into the datum
+ * and are NOT null terminated.  Use email_restore_case to get the local
+ * part as it was typed in.
+ */
+typedef struct EmailParts
+{
+	const char *local;
+	const char *domain;
+	int			local_len;
+	int			domain_len;
+	uint8		flags;
+	const uint8 *casemap;            // upper case positions of local, or NULL
+	int			domain_id;           // email_domains id of the domain, or 0
+}	EmailParts;
+
+#define PG_GETARG_EMAIL_P(n)	((EmailAddress *) PG_DETOAST_DATUM_PACKED(PG_GETARG_DATUM(n)))
 
 /*
  * Since we use V1 function calling convention, all these functions have
@@ -39,8 +295,18 @@ typedef struct EmailAddress
 /* Functions concerning the reading and displaying of type EmailAddress */ 
 Datum		email_in(PG_FUNCTION_ARGS);
 Datum		email_out(PG_FUNCTION_ARGS);
+Datum		email_text(PG_FUNCTION_ARGS);
+Datum		email_domain(PG_FUNCTION_ARGS);
+Datum		email_local(PG_FUNCTION_ARGS);
 Datum		email_recv(PG_FUNCTION_ARGS);
 Datum		email_send(PG_FUNCTION_ARGS);
+Datum		email_upgrade(PG_FUNCTION_ARGS);
+Datum		try_email_in(PG_FUNCTION_ARGS);
+Datum		email_is_valid(PG_FUNCTION_ARGS);
+Datum		email_validate(PG_FUNCTION_ARGS);
+Datum		email_parse_array(PG_FUNCTION_ARGS);
+Datum		email_parse_cache_stats(PG_FUNCTION_ARGS);
+Datum		email_stats(PG_FUNCTION_ARGS);
 
 /* Functions concerning the operators on EmailAddress */ 
 
@@ -51,21 +317,230 @@ Datum		email_ne(PG_FUNCTION_ARGS);
 Datum		email_ge(PG_FUNCTION_ARGS);
 Datum		email_gt(PG_FUNCTION_ARGS);
 Datum		email_cmp(PG_FUNCTION_ARGS);
+Datum		email_sortsupport(PG_FUNCTION_ARGS);
 Datum		email_de(PG_FUNCTION_ARGS);
 Datum		email_dne(PG_FUNCTION_ARGS);
+Datum		email_de_support(PG_FUNCTION_ARGS);
+Datum		email_typanalyze(PG_FUNCTION_ARGS);
+Datum		email_de_sel(PG_FUNCTION_ARGS);
+Datum		email_dne_sel(PG_FUNCTION_ARGS);
+Datum		email_de_joinsel(PG_FUNCTION_ARGS);
+Datum		email_dne_joinsel(PG_FUNCTION_ARGS);
+Datum		email_rdomain_lt(PG_FUNCTION_ARGS);
+Datum		email_rdomain_le(PG_FUNCTION_ARGS);
+Datum		email_rdomain_ge(PG_FUNCTION_ARGS);
+Datum		email_rdomain_gt(PG_FUNCTION_ARGS);
+Datum		email_rdomain_cmp(PG_FUNCTION_ARGS);
+Datum		email_reverse_domain(PG_FUNCTION_ARGS);
+Datum		email_within(PG_FUNCTION_ARGS);
+Datum		email_within_support(PG_FUNCTION_ARGS);
+Datum		email_within_sel(PG_FUNCTION_ARGS);
+Datum		email_starts_with(PG_FUNCTION_ARGS);
+Datum		email_starts_with_support(PG_FUNCTION_ARGS);
+Datum		email_spg_config(PG_FUNCTION_ARGS);
+Datum		email_spg_choose(PG_FUNCTION_ARGS);
+Datum		email_spg_inner_consistent(PG_FUNCTION_ARGS);
+Datum		email_spg_leaf_consistent(PG_FUNCTION_ARGS);
+Datum		email_spg_compress(PG_FUNCTION_ARGS);
+Datum		email_similarity(PG_FUNCTION_ARGS);
+Datum		email_similar(PG_FUNCTION_ARGS);
+Datum		email_contains(PG_FUNCTION_ARGS);
+Datum		email_gin_extract_value(PG_FUNCTION_ARGS);
+Datum		email_gin_extract_query(PG_FUNCTION_ARGS);
+Datum		email_gin_consistent(PG_FUNCTION_ARGS);
+Datum		email_hash(PG_FUNCTION_ARGS);
+Datum		email_hash_extended(PG_FUNCTION_ARGS);
+Datum		email_canonical(PG_FUNCTION_ARGS);
+Datum		email_typmod_in(PG_FUNCTION_ARGS);
+Datum		email_typmod_out(PG_FUNCTION_ARGS);
+Datum		email_coerce(PG_FUNCTION_ARGS);
+Datum		email_canon_lt(PG_FUNCTION_ARGS);
+Datum		email_canon_le(PG_FUNCTION_ARGS);
+Datum		email_canon_eq(PG_FUNCTION_ARGS);
+Datum		email_canon_ge(PG_FUNCTION_ARGS);
+Datum		email_canon_gt(PG_FUNCTION_ARGS);
+Datum		email_canon_cmp(PG_FUNCTION_ARGS);
+Datum		email_canon_hash(PG_FUNCTION_ARGS);
+Datum		email_canon_hash_extended(PG_FUNCTION_ARGS);
 
 
 /* Function Prototypes */
 
-int isValidCharacter (char c);
-int getLocalStringEnd (char *str, int len);
-int getDomainStringEnd (int start, char *str, int len);
-int checkLocalIsValid (char *local);
-int checkDomainIsValid (char *domain);
-int regexMatch (char *string, char *pattern);
+void email_unpack (EmailAddress *email, EmailParts *parts);
+EmailAddress *email_pack (const char *local, int local_len,
+                          const char *domain, int domain_len, int store);
+int email_pack_into (EmailAddress *result, const char *local, int local_len,
+                     const char *domain, int domain_len, int store);
+EmailAddress *email_try_parse (const char *str, int store);
+EmailAddress *email_cache_lookup (const char *str, int store);
+void email_cache_insert (const char *str, int store, EmailAddress *value);
+void email_canonical_parts (EmailAddress *email, char *buf, EmailParts *parts);
+EmailAddress *email_pack_input (const char *str, EmailParse *parse, int32 typmod, int store);
+int email_canon_cmp_internal (EmailAddress *a, EmailAddress *b);
+int email_domain_lookup (const char *domain, int domain_len);
+int email_domain_slot (const char *domain, int domain_len);
+int email_store_flags (void);
+const char *email_restore_case (EmailParts *parts, char *buf);
+int email_write_text (EmailParts *parts, char *dst);
 int email_cmp_internal(EmailAddress * a, EmailAddress * b);
+int email_fold_key (EmailAddress *email, char *buf);
+int email_fold_parts (EmailParts *parts, char *buf);
 int domain_cmp_internal(EmailAddress * a, EmailAddress * b);
-void print_error (char *string);
+int rdomain_casecmp (const char *a, int a_len, const char *b, int b_len);
+int email_rdomain_cmp_internal(EmailAddress * a, EmailAddress * b);
+int domain_is_within (EmailParts *parts, const char *suffix, int suffix_len);
+int reverse_domain (const char *domain, int domain_len, char *dst);
+void email_prefix_parse (text *pattern, EmailParts *parts);
+int email_spg_key (EmailParts *parts, char *buf);
+char *fold_text (text *txt, int *len);
+int email_trigrams (const char *str, int len, bool pad, int32 *trgm);
+float4 trigram_similarity (const int32 *a, int a_len, const int32 *b, int b_len);
+float4 email_similarity_internal (EmailAddress *email, text *query);
+void print_error (char *string, Node *escontext);
+void email_stats_flush (void);
+void _PG_init (void);
+
+/*
+ * The cluster wide counters of email_stats, in shared memory when the
+ * module is in shared_preload_libraries.  Backends add their counts at
+ * the end of each transaction, so the hot paths never touch shared memory.
+ */
+typedef struct EmailSharedStats
+{
+	pg_atomic_uint64 counters[EMAIL_NUM_STATS];
+}	EmailSharedStats;
+
+static EmailSharedStats *email_shared_stats = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+
+static void
+email_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+	RequestAddinShmemSpace(sizeof(EmailSharedStats));
+}
+#endif
+
+static void
+email_shmem_startup(void)
+{
+	bool		found;
+	int			i;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	email_shared_stats = (EmailSharedStats *)
+		ShmemInitStruct("email stats", sizeof(EmailSharedStats), &found);
+	if (!found)
+		for (i = 0; i < EMAIL_NUM_STATS; i++)
+			pg_atomic_init_u64(&email_shared_stats->counters[i], 0);
+	LWLockRelease(AddinShmemInitLock);
+}
+
+static void
+email_stats_xact_callback(XactEvent event, void *arg)
+{
+	if (email_stats_dirty)
+		email_stats_flush();
+}
+
+/**
+   Module load callback, defines the GUCs of this module.
+*/
+void _PG_init (void) {
+	static const struct config_enum_entry fold_case_options[] = {
+		{"none", 0, false},
+		{"domain", EMAIL_FLAG_DOMAIN_FOLDED, false},
+		{"all", EMAIL_FLAG_DOMAIN_FOLDED | EMAIL_FLAG_LOCAL_FOLDED, false},
+		{NULL, 0, false}
+	};
+
+	DefineCustomEnumVariable("email.fold_case",
+	                         "Stores new values with a lower cased domain, or lower cased domain and local part.",
+	                         "Folded values compare with memcmp. A domain is only folded if it is lower case already, and a folded local part keeps its original case for output.",
+	                         &email_fold_case,
+	                         0,
+	                         fold_case_options,
+	                         PGC_USERSET,
+	                         0,
+	                         NULL, NULL, NULL);
+	DefineCustomBoolVariable("email.encode_domains",
+	                         "Stores common domains as a one byte dictionary id.",
+	                         "Values stored this way can not be read by versions of the module without the dictionary.",
+	                         &email_encode_domains,
+	                         false,
+	                         PGC_USERSET,
+	                         0,
+	                         NULL, NULL, NULL);
+	DefineCustomIntVariable("email.parse_cache_size",
+	                        "Sets the number of input strings each backend remembers the parsed value of.",
+	                        "email_in answers a repeated string from the cache, skipping validation. 0 turns the cache off.",
+	                        &email_parse_cache_size,
+	                        0,
+	                        0,
+	                        65536,
+	                        PGC_USERSET,
+	                        0,
+	                        NULL, email_cache_size_assign, NULL);
+	DefineCustomRealVariable("email.similarity_threshold",
+	                         "Sets the trigram similarity at which the % operator considers two addresses alike.",
+	                         NULL,
+	                         &email_similarity_threshold,
+	                         0.3,
+	                         0.0,
+	                         1.0,
+	                         PGC_USERSET,
+	                         0,
+	                         NULL, NULL, NULL);
+	DefineCustomBoolVariable("email.track_stats",
+	                         "Counts parses, parse failures, comparisons and allocated bytes for email_stats.",
+	                         NULL,
+	                         &email_track_stats,
+	                         false,
+	                         PGC_SUSET,
+	                         0,
+	                         NULL, NULL, NULL);
+	DefineCustomBoolVariable("email.trace_parse",
+	                         "Logs why email_in accepts or rejects each value, at DEBUG2.",
+	                         NULL,
+	                         &email_trace_parse,
+	                         false,
+	                         PGC_USERSET,
+	                         0,
+	                         NULL, NULL, NULL);
+
+	// cluster wide counts need shared memory, so shared_preload_libraries
+	if (process_shared_preload_libraries_in_progress) {
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = email_shmem_request;
+#else
+		RequestAddinShmemSpace(sizeof(EmailSharedStats));
+#endif
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = email_shmem_startup;
+	}
+	RegisterXactCallback(email_stats_xact_callback, NULL);
+
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("email");
+#else
+	EmitWarningsOnPlaceholders("email");
+#endif
+}
+
+/**
+   How new values are to be stored, as set by the GUCs.
+   @RETURN: the store bits for email_pack.
+*/
+int email_store_flags (void) {
+	return email_fold_case | (email_encode_domains ? EMAIL_FLAG_DOMAIN_ID : 0);
+}
 
 /*****************************************************************************
  * Input/Output functions
@@ -77,199 +552,403 @@ Datum
 email_in(PG_FUNCTION_ARGS)
 {
    // Get input string
-	char *str = PG_GETARG_CSTRING(0);
-	/* Create pointer to EmailAddress data structure, allocating
-	   memory to it. Then set the length element of the structure
-	   using the macro SET_VARSIZE.
-	   NOTE: VARHDRSZ = sizeof(int32) = 4 bytes.
-	*/
-	EmailAddress *result = (EmailAddress *) palloc(VARHDRSZ + 256);
-	SET_VARSIZE(result,VARHDRSZ + 256);
-
-	/* Scan string and split into substrings local and domain*/
-	
-	int str_len = strlen(str);    // Get the length of the input string
-	int i = 0;                    // array index placeholder
-	// Iterate through the input string to the '@' symbol.
-	i = getLocalStringEnd(str, str_len);
-	// If i == 0, then there is no local part.
-	if (!i) print_error(str);
-	
-	// create temporary local string
-	char local[i];
-	memcpy(local, &str[0],i - 1);
-	local[i - 1] = '\0';
-	
-   // store the position of the '@' (one to the right of)
-	int at_pos = i;
-	i = getDomainStringEnd (i,str,str_len);
-	// If an error occured in getDomainStringEnd, send error.
-	if (!i) print_error(str);
-
-	// Create temporary domain string and copy content.
-	char domain[i - (at_pos + 1)];
-	memcpy(domain, &str[at_pos],i - 1);
-	domain[i - 1] = '\0';
-
-   /* Validate local and domain strings */
-   if( ! checkLocalIsValid(local)) print_error(local);
-   if( ! checkDomainIsValid(domain)) print_error(domain);
-	/* Initialise EmailAddress data structure and copy in content */ 	
-	memset(result->local,0,MAX_CHARS);
-	memset(result->domain,0,MAX_CHARS);
-	strcpy(result->local,local);
-	strcpy(result->domain,domain);
+	char	   *str = PG_GETARG_CSTRING(0);
+	int32		typmod = PG_NARGS() > 2 ? PG_GETARG_INT32(2) : -1;
+	EmailParse	parse;
+	EmailParseStatus status;
+	EmailAddress *result;
+	int			store = email_store_flags();
+	int			key = store | (typmod == EMAIL_TYPMOD_CANONICAL ? EMAIL_CACHE_CANONICAL : 0);
+
+	EMAIL_COUNT(EMAIL_STAT_PARSES, 1);
+
+	/* A string seen before needs no parsing at all */
+	if (email_parse_cache_size > 0 &&
+	    (result = email_cache_lookup(str, key)) != NULL)
+		PG_RETURN_POINTER(result);
+
+	/* Validate and split the string in a single scan */
+	status = parseEmailInput(str, &parse);
+	if (status != EMAIL_PARSE_OK) {
+		EMAIL_TRACE("email_in: \"%s\": %s at byte %d",
+		            str, parseStatusMessage(status), parse.error_pos);
+		EMAIL_COUNT(EMAIL_STAT_PARSES + status, 1);
+		print_error(str, fcinfo->context);
+		PG_RETURN_POINTER(NULL);
+	}
+	EMAIL_TRACE("email_in: \"%s\": local %d bytes, domain %d bytes",
+	            str, parse.local_len, parse.domain_len);
+
+	/* Copy both parts straight into a datum sized exactly to fit */
+	result = email_pack_input(str, &parse, typmod, store);
+	if (email_parse_cache_size > 0)
+		email_cache_insert(str, key, result);
 	PG_RETURN_POINTER(result);
 }
 
 
 /**
-   Send error message to psql, and print error message.
+   Send error message to psql, and print error message.  From PostgreSQL
+   16 on, the error is only saved in escontext when the caller passed one
+   (soft errors, as for pg_input_is_valid or COPY ... ON_ERROR), and
+   print_error then returns.
    @PARAMS string: the string containing the error
+           escontext: the fcinfo->context of the input function, or NULL
 */
-void print_error (char *string) {
+void print_error (char *string, Node *escontext) {
+#if PG_VERSION_NUM >= 160000
+   errsave(escontext,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for email address: \"%s\"",
+						string)));
+#else
    ereport(ERROR,
 				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
 				 errmsg("invalid input syntax for email address: \"%s\"",
 						string)));
+#endif
    return;
 }
 
 
-/**
-   Verify that email address rules are satisfied for local.
-   @PARAMS local: The string to validate.
-   @RETURN: Returns TRUE (1) if the string is valid,
-            FALSE (0) otherwise. 
-*/
-int checkLocalIsValid (char *local) {
-	int valid = TRUE;    // valid is set to TRUE by default.
-
-	//TODO: insert regex tests here:
-	if(! regexMatch(local,"((^[a-zA-Z])+(([-]*[a-zA-z0-9]))*(([\.])([a-zA-Z])+(([-]*[a-zA-z0-9]))*)*)$")) valid = FALSE;
+/*****************************************************************************
+ * Input without errors
+ *
+ * For bulk loads and cleanup jobs, which would otherwise have to catch an
+ * ERROR for every bad row.  Invalid input comes back as NULL, or as the
+ * reason it was rejected.
+ *****************************************************************************/
 
-//	if (! regexMatch(local,"^[A-Z]")) valid = FALSE;
-//	if (regexMatch(local,"\b[A-Z]+[A-Z0-9]*\b")) valid = FALSE;
+PG_FUNCTION_INFO_V1(email_is_valid);
 
-	return valid;
+Datum
+email_is_valid(PG_FUNCTION_ARGS)
+{
+	char	   *str = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	EmailParse	parse;
+	EmailParseStatus status;
+
+	EMAIL_COUNT(EMAIL_STAT_PARSES, 1);
+	status = parseEmailInput(str, &parse);
+	if (status != EMAIL_PARSE_OK)
+		EMAIL_COUNT(EMAIL_STAT_PARSES + status, 1);
+	PG_RETURN_BOOL(status == EMAIL_PARSE_OK);
 }
 
-
 /**
-   Verify that email address rules are satisfied for domain.
-   @PARAMS domain: The string to validate.
-   @RETURN: Returns TRUE (1) if the string is valid,
-            FALSE (0) otherwise. 
+   Tells whether a text is a valid address and, if not, why not and at
+   which character (counting from 1) email_in gave up on it.
 */
-int checkDomainIsValid (char *domain) {
-	int valid = TRUE;
-	// TODO: Put your domain validation regex here:
+PG_FUNCTION_INFO_V1(email_validate);
 
-	if (! regexMatch(domain,"((^[a-zA-Z])+(([-]*[a-zA-z0-9]))*(([\.])([a-zA-Z])+(([-]*[a-zA-z0-9]))*)+)$")) valid = FALSE;
-	
-	return valid;
+Datum
+email_validate(PG_FUNCTION_ARGS)
+{
+	char	   *str = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	EmailParse	parse;
+	EmailParseStatus status;
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		nulls[3] = {false, false, false};
+
+	EMAIL_COUNT(EMAIL_STAT_PARSES, 1);
+	status = parseEmailInput(str, &parse);
+	if (status != EMAIL_PARSE_OK)
+		EMAIL_COUNT(EMAIL_STAT_PARSES + status, 1);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	values[0] = BoolGetDatum(status == EMAIL_PARSE_OK);
+	if (status == EMAIL_PARSE_OK)
+		nulls[1] = nulls[2] = true;
+	else {
+		values[1] = CStringGetTextDatum(parseStatusMessage(status));
+		values[2] = Int32GetDatum(parse.error_pos + 1);
+	}
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+	                                                  values, nulls)));
 }
+
 /**
-	Regular Expression Match. Uses extended regex and ignores case.
-	@PARAMS  string: The string to check.
-	         pattern: The regex pattern to check against.
-	@RETURN: If there is a match, the function will return TRUE (int 1),
-	         otherwise FALSE (0).
+   Parses the text form of an address like email_in does, but without
+   raising an error.
+   @PARAMS str: the null terminated text.
+           store: the store bits for email_pack.
+   @RETURN: the palloc'd EmailAddress, or NULL if str is not valid.
 */
-int regexMatch (char *string, char *pattern) {
-	int status;					// determine if error in compilation or execution
-	regex_t regex;				// store compiled regex
-	int match = FALSE;
-	// Compile regular expression
-	status = regcomp(&regex,pattern, REG_EXTENDED|REG_ICASE);
-	if (status) return (-1); 	// if not 0, error occured;
-	// Execute regular expression
-	status = regexec(&regex, string, (size_t) 0, NULL, 0);
-	regfree(&regex);
-	// if status == 0, then there is a match.
-	if (!status) match = TRUE;
-	return match;	
+EmailAddress *email_try_parse (const char *str, int store) {
+	EmailParse	parse;
+	EmailParseStatus status;
+
+	EMAIL_COUNT(EMAIL_STAT_PARSES, 1);
+	status = parseEmailInput(str, &parse);
+	if (status != EMAIL_PARSE_OK) {
+		EMAIL_TRACE("try_email_in: \"%s\": %s at byte %d",
+		            str, parseStatusMessage(status), parse.error_pos);
+		EMAIL_COUNT(EMAIL_STAT_PARSES + status, 1);
+		return NULL;
+	}
+	return email_pack(str, parse.local_len,
+	                  str + parse.local_len + 1, parse.domain_len, store);
+}
+
+PG_FUNCTION_INFO_V1(try_email_in);
+
+Datum
+try_email_in(PG_FUNCTION_ARGS)
+{
+	char	   *str = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	EmailAddress *result = email_try_parse(str, email_store_flags());
+
+	if (result == NULL)
+		PG_RETURN_NULL();
+	PG_RETURN_POINTER(result);
 }
 
 /**
-	Does basic character validation for the domain substring.
-	If an error is detected, 0 is returned.
+   Parses a whole array of texts in one call.  Every element is parsed in
+   the same buffer and packed into one chunk, sized up front from the
+   lengths of the texts; the result has the shape of the input, with NULL
+   for the elements that are NULL or invalid.
 */
-int getDomainStringEnd (int start, char *str, int len) {
-	int i = start;
-	int end_pos = 0;
-	int error = FALSE;
-	char c = 0;
-	for (i = i; i < len; i += 1) {
-		c = str[i];
-		printf("%c",c);
-		if (!isValidCharacter(c)) {
-			printf("Invalid Character\n");
-			error = TRUE;
-			break;
+PG_FUNCTION_INFO_V1(email_parse_array);
+
+Datum
+email_parse_array(PG_FUNCTION_ARGS)
+{
+	ArrayType  *input = PG_GETARG_ARRAYTYPE_P(0);
+	Oid			email_type = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+	int			store = email_store_flags();
+	Datum	   *elems;
+	bool	   *nulls;
+	Size		chunk_size = 0;
+	char	   *chunk, *buf;
+	int			nelems, max_len = 0, i;
+
+	if (!OidIsValid(email_type))
+		elog(ERROR, "could not determine the element type of the result");
+	deconstruct_array(input, TEXTOID, -1, false, 'i', &elems, &nulls, &nelems);
+
+	// the address of a text of len bytes has parts of less than len in all
+	for (i = 0; i < nelems; i++) {
+		if (!nulls[i]) {
+			int			len = VARSIZE_ANY_EXHDR(DatumGetPointer(elems[i]));
+
+			chunk_size += INTALIGN(EMAIL_PACKED_MAX(len, 0));
+			max_len = Max(max_len, len);
 		}
-		else if (c == '@') {
-			printf("Invalid Character\n");
-			error = TRUE;
-			break;
-		}		
 	}
-	if (!error) {
-		end_pos = i;
+	chunk = (char *) palloc(Max(chunk_size, 1));
+	EMAIL_COUNT(EMAIL_STAT_BYTES, chunk_size);
+	buf = (char *) palloc(max_len + 1);
+
+	for (i = 0; i < nelems; i++) {
+		EmailParse	parse;
+		EmailParseStatus status;
+		int			len;
+
+		if (nulls[i])
+			continue;
+		len = VARSIZE_ANY_EXHDR(DatumGetPointer(elems[i]));
+		memcpy(buf, VARDATA_ANY(DatumGetPointer(elems[i])), len);
+		buf[len] = '\0';
+
+		EMAIL_COUNT(EMAIL_STAT_PARSES, 1);
+		status = parseEmailInput(buf, &parse);
+		if (status != EMAIL_PARSE_OK) {
+			EMAIL_TRACE("email_parse_array: \"%s\": %s at byte %d",
+			            buf, parseStatusMessage(status), parse.error_pos);
+			EMAIL_COUNT(EMAIL_STAT_PARSES + status, 1);
+			nulls[i] = true;
+			continue;
+		}
+		elems[i] = PointerGetDatum(chunk);
+		chunk += INTALIGN(email_pack_into((EmailAddress *) chunk, buf, parse.local_len,
+		                                  buf + parse.local_len + 1, parse.domain_len,
+		                                  store));
 	}
-	return end_pos;
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, nulls, ARR_NDIM(input),
+	                                         ARR_DIMS(input), ARR_LBOUND(input),
+	                                         email_type, -1, false, 'i'));
+}
+
+
+/*****************************************************************************
+ * Parse cache
+ *
+ * Applications tend to send the same addresses over and over, as bound
+ * parameters in text form.  With email.parse_cache_size above 0, email_in
+ * keeps the last that many strings it parsed, with the values it made of
+ * them, and hands out a copy when a string comes again.  The cache is
+ * local to the backend and lives in TopMemoryContext; the least recently
+ * used entry makes room for a new one.  The value of a string also
+ * depends on the store bits (email.fold_case, email.encode_domains) and
+ * on whether the column is EmailAddress(canonical), so they are part of
+ * the key.
+ *****************************************************************************/
+
+typedef struct EmailCacheKey
+{
+	int			store;               // store bits, and EMAIL_CACHE_CANONICAL
+	char		str[2 * MAX_CHARS];  // the input string, null terminated
+}	EmailCacheKey;
+
+typedef struct EmailCacheEntry
+{
+	EmailCacheKey key;               // hash key, must be first
+	dlist_node	lru;                 // in email_cache_lru, most recent first
+	union
+	{
+		int32		align;
+		char		data[EMAIL_PACKED_MAX(MAX_CHARS, MAX_CHARS)];
+	}			value;               // the EmailAddress made of key.str
+}	EmailCacheEntry;
+
+static HTAB *email_cache = NULL;
+static int email_cache_capacity = 0;
+static dlist_head email_cache_lru;
+static uint64 email_cache_hits = 0;
+static uint64 email_cache_misses = 0;
+
+static uint32
+email_cache_hash(const void *key, Size keysize)
+{
+	const EmailCacheKey *k = (const EmailCacheKey *) key;
+
+	return DatumGetUInt32(hash_any((const unsigned char *) k->str, strlen(k->str))) ^
+		(uint32) k->store;
 }
 
+static int
+email_cache_match(const void *key1, const void *key2, Size keysize)
+{
+	const EmailCacheKey *a = (const EmailCacheKey *) key1;
+	const EmailCacheKey *b = (const EmailCacheKey *) key2;
+
+	return a->store != b->store || strcmp(a->str, b->str) != 0;
+}
 
 /**
-	Given a string, this function iterates over it until
-	the first '@' symbol is found, return it's position.
-	If an error is detected, 0 will be returned.
+   Assign hook of email.parse_cache_size.  Turning the cache off hands its
+   memory back; any other size is taken up by the next lookup.
 */
+static void
+email_cache_size_assign(int newval, void *extra)
+{
+	if (newval == 0 && email_cache != NULL) {
+		hash_destroy(email_cache);
+		email_cache = NULL;
+		email_cache_capacity = 0;
+		dlist_init(&email_cache_lru);
+	}
+}
 
-int getLocalStringEnd (char *str, int len) {
-	int i = 0;
-	int end_pos = 0;
-	int error = FALSE;
-	char c = 0;
-	for (i = 0; i < len && c != '@'; i++)
-	{
-		c = str[i];
-		printf("%c",c);
-		if (!isValidCharacter(c)) {
-			printf("Invalid Character\n");
-			error = TRUE;
-			break;
-		}
-		else if (i == 0 && c == '@') {
-			printf("No Local\n");
-			error = TRUE;
-			break;
-		}			  	
+/**
+   Makes the cache key of an input string.
+   @RETURN: FALSE (0) if the string is too long to be cached.
+*/
+static int
+email_cache_key(const char *str, int store, EmailCacheKey *key)
+{
+	size_t		len = strlen(str);
+
+	if (len >= sizeof(key->str))
+		return FALSE;
+	key->store = store;
+	memcpy(key->str, str, len + 1);
+	return TRUE;
+}
+
+/**
+   Looks an input string up in the cache, (re)creating the cache first if
+   email.parse_cache_size has changed.
+   @RETURN: a palloc'd copy of the value made of str, or NULL.
+*/
+EmailAddress *email_cache_lookup (const char *str, int store) {
+	EmailCacheKey key;
+	EmailCacheEntry *entry;
+	EmailAddress *result;
+
+	if (email_cache == NULL || email_cache_capacity != email_parse_cache_size) {
+		HASHCTL		ctl;
+
+		if (email_cache != NULL)
+			hash_destroy(email_cache);
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(EmailCacheKey);
+		ctl.entrysize = sizeof(EmailCacheEntry);
+		ctl.hash = email_cache_hash;
+		ctl.match = email_cache_match;
+		email_cache = hash_create("email_in parse cache", email_parse_cache_size, &ctl,
+		                          HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+		email_cache_capacity = email_parse_cache_size;
+		dlist_init(&email_cache_lru);
 	}
-	if (c == '@' && i >= len) {
-		printf("No Domain\n");
-		error = TRUE;
+
+	if (!email_cache_key(str, store, &key))
+		return NULL;
+	entry = (EmailCacheEntry *) hash_search(email_cache, &key, HASH_FIND, NULL);
+	if (entry == NULL) {
+		email_cache_misses += 1;
+		return NULL;
 	}
-	if (!error) {
-		end_pos = i;
+	email_cache_hits += 1;
+	dlist_move_head(&email_cache_lru, &entry->lru);
+	result = (EmailAddress *) palloc(VARSIZE(entry->value.data));
+	EMAIL_COUNT(EMAIL_STAT_BYTES, VARSIZE(entry->value.data));
+	memcpy(result, entry->value.data, VARSIZE(entry->value.data));
+	return result;
+}
+
+/**
+   Remembers the value email_in made of an input string, after a miss in
+   email_cache_lookup.
+*/
+void email_cache_insert (const char *str, int store, EmailAddress *value) {
+	EmailCacheKey key;
+	EmailCacheEntry *entry;
+	bool		found;
+
+	if (email_cache == NULL || email_cache_capacity != email_parse_cache_size ||
+	    !email_cache_key(str, store, &key))
+		return;
+
+	if (hash_get_num_entries(email_cache) >= email_cache_capacity) {
+		EmailCacheEntry *oldest = dlist_tail_element(EmailCacheEntry, lru, &email_cache_lru);
+
+		dlist_delete(&oldest->lru);
+		hash_search(email_cache, &oldest->key, HASH_REMOVE, NULL);
 	}
-	return end_pos;
+	entry = (EmailCacheEntry *) hash_search(email_cache, &key, HASH_ENTER, &found);
+	if (!found)
+		dlist_push_head(&email_cache_lru, &entry->lru);
+	memcpy(entry->value.data, value, VARSIZE(value));
 }
 
 /**
-   Checks ASCII values for invalid characters.
-   @PARAMS c: the character to check.
-   @RETURN: Returns TRUE (1) if character is valid,
-            FALSE (0) otherwise.
+   Reports on the parse cache of this backend: its size, how full it is,
+   and how many lookups it answered and missed.
 */
-int isValidCharacter (char c) {
-	int valid = TRUE;
-	if ( c < 48 && c != 46 && c != 45) valid = FALSE;	
-	else if (c > 57 && c < 64)	valid = FALSE;
-	else if (c > 90 && c < 97)	valid = FALSE;
-	else if (c > 122)	valid = FALSE;
-	return valid;
+PG_FUNCTION_INFO_V1(email_parse_cache_stats);
+
+Datum
+email_parse_cache_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[4];
+	bool		nulls[4] = {false, false, false, false};
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	values[0] = Int32GetDatum(email_parse_cache_size);
+	values[1] = Int32GetDatum(email_cache ? (int32) hash_get_num_entries(email_cache) : 0);
+	values[2] = Int64GetDatum((int64) email_cache_hits);
+	values[3] = Int64GetDatum((int64) email_cache_misses);
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+	                                                  values, nulls)));
 }
 
 
@@ -278,38 +957,405 @@ PG_FUNCTION_INFO_V1(email_out);
 Datum
 email_out(PG_FUNCTION_ARGS)
 {
-	EmailAddress    *email = (EmailAddress *) PG_GETARG_POINTER(0);
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	EmailParts	parts;
 	char	   *result;
 
-	result = (char *) palloc(256);
-	snprintf(result, 256, "%s@%s", email->local, email->domain);
+	email_unpack(email, &parts);
+	result = (char *) palloc(parts.local_len + parts.domain_len + 2);
+	EMAIL_COUNT(EMAIL_STAT_BYTES, parts.local_len + parts.domain_len + 2);
+	result[email_write_text(&parts, result)] = '\0';
 	PG_RETURN_CSTRING(result);
 }
 
+/**
+   The cast to text, written straight into the varlena.
+*/
+PG_FUNCTION_INFO_V1(email_text);
+
+Datum
+email_text(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	EmailParts	parts;
+	text	   *result;
+
+	email_unpack(email, &parts);
+	result = (text *) palloc(VARHDRSZ + parts.local_len + parts.domain_len + 1);
+	EMAIL_COUNT(EMAIL_STAT_BYTES, VARHDRSZ + parts.local_len + parts.domain_len + 1);
+	SET_VARSIZE(result, VARHDRSZ + email_write_text(&parts, VARDATA(result)));
+	PG_RETURN_TEXT_P(result);
+}
+
+/**
+   The domain of an address, as email_out prints it.
+*/
+PG_FUNCTION_INFO_V1(email_domain);
+
+Datum
+email_domain(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	EmailParts	parts;
+
+	email_unpack(email, &parts);
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(parts.domain, parts.domain_len));
+}
+
+/**
+   The local part of an address, in its original case.
+*/
+PG_FUNCTION_INFO_V1(email_local);
+
+Datum
+email_local(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	EmailParts	parts;
+	text	   *result;
+
+	email_unpack(email, &parts);
+	result = (text *) palloc(VARHDRSZ + parts.local_len);
+	SET_VARSIZE(result, VARHDRSZ + parts.local_len);
+	if (email_restore_case(&parts, VARDATA(result)) != VARDATA(result))
+		memcpy(VARDATA(result), parts.local, parts.local_len);
+	PG_RETURN_TEXT_P(result);
+}
+
+/**
+   Writes the text form of an address, with the local part in its original
+   case.  Nothing is parsed or counted, the lengths come from the datum.
+   @PARAMS parts: the unpacked address.
+           dst: where to write, with room for local_len + domain_len + 1
+                bytes.  No terminator is added.
+   @RETURN: the number of bytes written.
+*/
+int email_write_text (EmailParts *parts, char *dst) {
+	const char *local = email_restore_case(parts, dst);
+
+	if (local != dst)
+		memcpy(dst, local, parts->local_len);
+	dst[parts->local_len] = '@';
+	memcpy(dst + parts->local_len + 1, parts->domain, parts->domain_len);
+	return parts->local_len + 1 + parts->domain_len;
+}
+
+/**
+   Builds a packed EmailAddress from its two parts.  The datum is
+   allocated for the worst case casemap, which is a few bytes at most.
+   @PARAMS local, local_len: the local part and its length.
+           domain, domain_len: the domain part and its length.
+           store: EMAIL_FLAG_*_FOLDED bits of the parts to lower case, and
+                  EMAIL_FLAG_DOMAIN_ID to use the domain dictionary.
+   @RETURN: the palloc'd EmailAddress.
+*/
+EmailAddress *email_pack (const char *local, int local_len,
+                          const char *domain, int domain_len, int store) {
+	EmailAddress *result;
+
+	result = (EmailAddress *) palloc(EMAIL_PACKED_MAX(local_len, domain_len));
+	EMAIL_COUNT(EMAIL_STAT_BYTES, EMAIL_PACKED_MAX(local_len, domain_len));
+	email_pack_into(result, local, local_len, domain, domain_len, store);
+	return result;
+}
+
+/**
+   Builds a packed EmailAddress in memory supplied by the caller.
+   @PARAMS result: where to build it, with room for
+                   EMAIL_PACKED_MAX(local_len, domain_len) bytes.
+           The other parameters are those of email_pack.
+   @RETURN: the size of the datum.
+*/
+int email_pack_into (EmailAddress *result, const char *local, int local_len,
+                     const char *domain, int domain_len, int store) {
+	int map_len = 0;
+	int domain_id = 0;
+	int size, i;
+	EmailHeader *hdr;
+	char *dst;
+
+	// a domain is only marked folded or looked up in the dictionary when
+	// it is lower case already, so the stored value still prints exactly
+	// as it was written
+	if (store & (EMAIL_FLAG_DOMAIN_FOLDED | EMAIL_FLAG_DOMAIN_ID)) {
+		for (i = 0; i < domain_len; i++) {
+			if (ASCII_ISUPPER(domain[i])) {
+				store &= ~(EMAIL_FLAG_DOMAIN_FOLDED | EMAIL_FLAG_DOMAIN_ID);
+				break;
+			}
+		}
+	}
+
+	// a folded local part needs a case bitmap, if it has upper case at all
+	if (store & EMAIL_FLAG_LOCAL_FOLDED) {
+		for (i = 0; i < local_len; i++) {
+			if (ASCII_ISUPPER(local[i])) {
+				map_len = (local_len + 7) / 8;
+				break;
+			}
+		}
+	}
+
+	// a dictionary domain takes a single byte, and is lower case like the
+	// dictionary entry it matched
+	if (store & EMAIL_FLAG_DOMAIN_ID)
+		domain_id = email_domain_lookup(domain, domain_len);
+	if (domain_id)
+		store |= EMAIL_FLAG_DOMAIN_FOLDED;
+	else
+		store &= ~EMAIL_FLAG_DOMAIN_ID;
+
+	size = VARHDRSZ + EMAIL_HDRSZ + local_len + map_len +
+		(domain_id ? 1 : domain_len);
+	SET_VARSIZE(result, size);
+	hdr = (EmailHeader *) VARDATA(result);
+	hdr->flags = store | (map_len ? EMAIL_FLAG_LOCAL_CASEMAP : 0);
+	hdr->local_len = (uint8) local_len;
+	dst = VARDATA(result) + EMAIL_HDRSZ;
+
+	if (store & EMAIL_FLAG_LOCAL_FOLDED) {
+		uint8 *map = (uint8 *) dst + local_len + (domain_id ? 1 : domain_len);
+
+		memset(map, 0, map_len);
+		for (i = 0; i < local_len; i++) {
+			if (ASCII_ISUPPER(local[i]))
+				map[i >> 3] |= 1 << (i & 7);
+			dst[i] = ASCII_TOLOWER(local[i]);
+		}
+	}
+	else
+		memcpy(dst, local, local_len);
+	dst += local_len;
+
+	if (domain_id)
+		*dst = (char) domain_id;
+	else
+		memcpy(dst, domain, domain_len);
+	return size;
+}
+
+/**
+   Splits an EmailAddress into its local and domain parts, without
+   copying.  Both the packed and the legacy fixed layout are understood.
+   A dictionary domain is resolved to its entry in email_domains.
+   @PARAMS email: the (possibly short header) datum to read.
+           parts: filled in with pointers into the datum.
+*/
+void email_unpack (EmailAddress *email, EmailParts *parts) {
+	const char *data = VARDATA_ANY(email);
+
+	parts->casemap = NULL;
+	parts->domain_id = 0;
+	if ((uint8) data[0] >= EMAIL_FLAGS_LEGACY_MIN) {
+		// old layout: two null padded MAX_CHARS arrays
+		parts->flags = 0;
+		parts->local = data;
+		parts->local_len = strnlen(data, MAX_CHARS);
+		parts->domain = data + MAX_CHARS;
+		parts->domain_len = strnlen(data + MAX_CHARS, MAX_CHARS);
+		return;
+	}
+	parts->flags = ((const EmailHeader *) data)->flags;
+	parts->local_len = ((const EmailHeader *) data)->local_len;
+	parts->local = data + EMAIL_HDRSZ;
+	parts->domain = parts->local + parts->local_len;
+	parts->domain_len = VARSIZE_ANY_EXHDR(email) - EMAIL_HDRSZ - parts->local_len;
+	if (parts->flags & EMAIL_FLAG_LOCAL_CASEMAP) {
+		parts->domain_len -= (parts->local_len + 7) / 8;
+		parts->casemap = (const uint8 *) parts->domain + parts->domain_len;
+	}
+	if (parts->flags & EMAIL_FLAG_DOMAIN_ID) {
+		int id = (uint8) parts->domain[0];
+
+		if (parts->domain_len != 1 || id < 1 || id > EMAIL_NUM_DOMAINS)
+			elog(ERROR, "invalid domain dictionary id in email address");
+		parts->domain_id = id;
+		parts->domain = email_domains[id - 1].name;
+		parts->domain_len = email_domains[id - 1].len;
+	}
+}
+
+/**
+   Finds a domain in the dictionary, ignoring case.
+   @RETURN: its id, or 0 if it is not in the dictionary.
+*/
+int email_domain_lookup (const char *domain, int domain_len) {
+	int lo = 0, hi = EMAIL_NUM_DOMAINS - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		int r = parts_casecmp(domain, domain_len,
+		                      email_domains[mid].name, email_domains[mid].len);
+
+		if (r == 0)
+			return mid + 1;
+		if (r < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return 0;
+}
+
+/**
+   Places a domain among the dictionary entries, for the sort abbreviation.
+   Slot 2k + 1 is the k-th entry itself, slot 2k is every domain between
+   entries k - 1 and k, so slots are in domain order.
+   @PARAMS domain: the domain, any case, not null terminated.
+   @RETURN: 0 to 2 * EMAIL_NUM_DOMAINS.
+*/
+int email_domain_slot (const char *domain, int domain_len) {
+	int lo = 0, hi = EMAIL_NUM_DOMAINS - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		int r = parts_casecmp(domain, domain_len,
+		                      email_domains[mid].name, email_domains[mid].len);
+
+		if (r == 0)
+			return 2 * mid + 1;
+		if (r < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return 2 * lo;
+}
+
+/**
+   Gives the local part with its original case.
+   @PARAMS parts: an unpacked address.
+           buf: room for MAX_CHARS bytes, used if the case must be rebuilt.
+   @RETURN: the local part, parts->local_len bytes long.
+*/
+const char *email_restore_case (EmailParts *parts, char *buf) {
+	int i;
+
+	if (parts->casemap == NULL)
+		return parts->local;
+	for (i = 0; i < parts->local_len; i++) {
+		char c = parts->local[i];
+
+		if (parts->casemap[i >> 3] & (1 << (i & 7)))
+			c -= 'a' - 'A';
+		buf[i] = c;
+	}
+	return buf;
+}
+
+/**
+   Rewrites a value in the packed layout, folded as email.fold_case says.
+   Used to migrate data that was stored by older versions of this module,
+   or to change how existing values are folded.
+*/
+PG_FUNCTION_INFO_V1(email_upgrade);
+
+Datum
+email_upgrade(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	EmailParts	parts;
+	char		local[MAX_CHARS];
+
+	email_unpack(email, &parts);
+	PG_RETURN_POINTER(email_pack(email_restore_case(&parts, local),
+	                             parts.local_len, parts.domain, parts.domain_len,
+	                             email_store_flags()));
+}
+
 /*****************************************************************************
  * Binary Input/Output functions
  *
  * These are optional.
+ *
+ * The wire format is versioned and length prefixed:
+ *
+ *     [version = 1][flags][local_len][local ...][domain_len][domain ...]
+ *
+ * The local part keeps its original case.  With EMAIL_WIRE_DOMAIN_ID in
+ * flags, the domain is a single email_domains id byte instead of a length
+ * and the name.  email_recv still takes that from older senders, but
+ * email_send always sends the name, so that its output does not depend on
+ * email.encode_domains and the reader needs no dictionary.  The old
+ * format, two null terminated strings, still comes in fine: it starts with
+ * a letter, and every version byte stays below EMAIL_FLAGS_LEGACY_MIN.
+ *
+ * Whatever comes in is checked with the email_in parser before it is
+ * stored.
  *****************************************************************************/
 
+#define EMAIL_WIRE_VERSION    1
+#define EMAIL_WIRE_DOMAIN_ID  0x01
+
 PG_FUNCTION_INFO_V1(email_recv);
 
 Datum
 email_recv(PG_FUNCTION_ARGS)
 {
 	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
-	EmailAddress    *result = (EmailAddress *) palloc(VARHDRSZ + 256);
-
-	const char *local = pq_getmsgstring(buf);
-	const char *domain = pq_getmsgstring(buf);
-
-   SET_VARSIZE(result,VARHDRSZ + 256);
-   memset(result->local,0,MAX_CHARS);
-	memset(result->domain,0,MAX_CHARS);
+	int32		typmod = PG_NARGS() > 2 ? PG_GETARG_INT32(2) : -1;
+	char		addr[2 * MAX_CHARS + 1];
+	const char *local, *domain;
+	int			local_len, domain_len;
+	EmailParse	parse;
+
+	if (buf->cursor < buf->len &&
+		(uint8) buf->data[buf->cursor] >= EMAIL_FLAGS_LEGACY_MIN) {
+		local = pq_getmsgstring(buf);
+		domain = pq_getmsgstring(buf);
+		local_len = strlen(local);
+		domain_len = strlen(domain);
+	}
+	else {
+		int			version = pq_getmsgbyte(buf);
+		int			flags;
+
+		if (version != EMAIL_WIRE_VERSION)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("unsupported email address binary format version %d",
+					        version)));
+		flags = pq_getmsgbyte(buf);
+		if (flags & ~EMAIL_WIRE_DOMAIN_ID)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid flags %d in external email address value", flags)));
+		local_len = pq_getmsgbyte(buf);
+		local = pq_getmsgbytes(buf, local_len);
+		if (flags & EMAIL_WIRE_DOMAIN_ID) {
+			int			id = pq_getmsgbyte(buf);
+
+			if (id < 1 || id > EMAIL_NUM_DOMAINS)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						 errmsg("invalid domain dictionary id %d in external email address value",
+						        id)));
+			domain = email_domains[id - 1].name;
+			domain_len = email_domains[id - 1].len;
+		}
+		else {
+			domain_len = pq_getmsgbyte(buf);
+			domain = pq_getmsgbytes(buf, domain_len);
+		}
+	}
 
-	strcpy(result->local,local);
-	strcpy(result->domain,domain);
-	PG_RETURN_POINTER(result);
+	if (local_len >= MAX_CHARS || domain_len >= MAX_CHARS)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("email address part too long in external binary value")));
+
+	// the parser checks the grammar, and any stray null byte cuts it short
+	memcpy(addr, local, local_len);
+	addr[local_len] = '@';
+	memcpy(addr + local_len + 1, domain, domain_len);
+	addr[local_len + 1 + domain_len] = '\0';
+	if (parseEmailInput(addr, &parse) != EMAIL_PARSE_OK ||
+		parse.local_len != local_len || parse.domain_len != domain_len)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid email address in external binary value")));
+
+	PG_RETURN_POINTER(email_pack_input(addr, &parse, typmod, email_store_flags()));
 }
 
 PG_FUNCTION_INFO_V1(email_send);
@@ -317,13 +1363,28 @@ PG_FUNCTION_INFO_V1(email_send);
 Datum
 email_send(PG_FUNCTION_ARGS)
 {
-	EmailAddress    *email = (EmailAddress *) PG_GETARG_POINTER(0);
-	StringInfoData buf;
-
-	pq_begintypsend(&buf);
-	pq_sendstring(&buf, email->local);
-	pq_sendstring(&buf, email->domain);
-	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	EmailParts	parts;
+	char		local[MAX_CHARS];
+	bytea	   *result;
+	char	   *dst;
+	int			size;
+
+	// a dictionary domain is unpacked to its name, which is what goes out
+	email_unpack(email, &parts);
+	size = VARHDRSZ + 4 + parts.local_len + parts.domain_len;
+	result = (bytea *) palloc(size);
+	SET_VARSIZE(result, size);
+	dst = VARDATA(result);
+
+	*dst++ = EMAIL_WIRE_VERSION;
+	*dst++ = 0;
+	*dst++ = (char) parts.local_len;
+	memcpy(dst, email_restore_case(&parts, local), parts.local_len);
+	dst += parts.local_len;
+	*dst++ = (char) parts.domain_len;
+	memcpy(dst, parts.domain, parts.domain_len);
+	PG_RETURN_BYTEA_P(result);
 }
 
 /*****************************************************************************
@@ -374,23 +1435,39 @@ email_send(PG_FUNCTION_ARGS)
 /*	return 0;*/
 /*}*/
 
+/*
+ * Compare the domains of two unpacked addresses.  Dictionary ids are in
+ * domain order, so two of them compare without looking at any bytes.
+ */
+#define DOMAIN_CMP(pa, pb) \
+	(((pa).domain_id && (pb).domain_id) ? (pa).domain_id - (pb).domain_id : \
+	 ((pa).flags & (pb).flags & EMAIL_FLAG_DOMAIN_FOLDED) ? \
+	 parts_memcmp((pa).domain, (pa).domain_len, (pb).domain, (pb).domain_len) : \
+	 parts_casecmp((pa).domain, (pa).domain_len, (pb).domain, (pb).domain_len))
+
+/* Compare the local parts of two unpacked addresses */
+#define LOCAL_CMP(pa, pb) \
+	(((pa).flags & (pb).flags & EMAIL_FLAG_LOCAL_FOLDED) ? \
+	 parts_memcmp((pa).local, (pa).local_len, (pb).local, (pb).local_len) : \
+	 parts_casecmp((pa).local, (pa).local_len, (pb).local, (pb).local_len))
+
 /**
-   Compares two EmailAddresses, domain first then local.
+   Compares two EmailAddresses, domain first then local.  Each part is
+   compared once, and the three-way result is returned as it comes.
+   Parts stored folded on both sides are compared with plain memcmp.
 */
 int email_cmp_internal(EmailAddress * a, EmailAddress * b)
 {
-	int result = 0;
+	int result;
+	EmailParts pa, pb;
 
-	if (strcasecmp(a->domain,b->domain) < 0)
-		result = -1;
-	else if (strcasecmp(a->domain,b->domain) > 0)
-		result = 1;
-	else if (strcasecmp(a->domain,b->domain) == 0) {
-      if (strcasecmp(a->local,b->local) < 0)
-         result = -1;
-      else if (strcasecmp(a->local,b->local) > 0)
-         result = 1;
-	}
+	EMAIL_COUNT(EMAIL_STAT_COMPARES, 1);
+	email_unpack(a, &pa);
+	email_unpack(b, &pb);
+
+	result = DOMAIN_CMP(pa, pb);
+	if (result == 0)
+		result = LOCAL_CMP(pa, pb);
 	return result;
 }
 
@@ -399,13 +1476,12 @@ int email_cmp_internal(EmailAddress * a, EmailAddress * b)
 */
 int domain_cmp_internal(EmailAddress * a, EmailAddress * b)
 {
-   int result = 0;
-   if (strcasecmp(a->domain,b->domain) < 0)
-		result = -1;
-	else if (strcasecmp(a->domain,b->domain) > 0)
-		result = 1;
+   EmailParts pa, pb;
 
-   return result;
+   email_unpack(a, &pa);
+   email_unpack(b, &pb);
+
+   return DOMAIN_CMP(pa, pb);
 }
 
 
@@ -414,8 +1490,8 @@ PG_FUNCTION_INFO_V1(email_lt);
 Datum
 email_lt(PG_FUNCTION_ARGS)
 {
-	EmailAddress    *a = (EmailAddress *) PG_GETARG_POINTER(0);
-	EmailAddress    *b = (EmailAddress *) PG_GETARG_POINTER(1);
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
 
 	PG_RETURN_BOOL(email_cmp_internal(a, b) < 0);
 }
@@ -425,8 +1501,8 @@ PG_FUNCTION_INFO_V1(email_le);
 Datum
 email_le(PG_FUNCTION_ARGS)
 {
-	EmailAddress    *a = (EmailAddress *) PG_GETARG_POINTER(0);
-	EmailAddress    *b = (EmailAddress *) PG_GETARG_POINTER(1);
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
 
 	PG_RETURN_BOOL(email_cmp_internal(a, b) <= 0);
 }
@@ -436,8 +1512,8 @@ PG_FUNCTION_INFO_V1(email_eq);
 Datum
 email_eq(PG_FUNCTION_ARGS)
 {
-	EmailAddress    *a = (EmailAddress *) PG_GETARG_POINTER(0);
-	EmailAddress    *b = (EmailAddress *) PG_GETARG_POINTER(1);
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
 
 	PG_RETURN_BOOL(email_cmp_internal(a, b) == 0);
 }
@@ -449,8 +1525,8 @@ PG_FUNCTION_INFO_V1(email_ge);
 Datum
 email_ge(PG_FUNCTION_ARGS)
 {
-	EmailAddress    *a = (EmailAddress *) PG_GETARG_POINTER(0);
-	EmailAddress    *b = (EmailAddress *) PG_GETARG_POINTER(1);
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
 
 	PG_RETURN_BOOL(email_cmp_internal(a, b) >= 0);
 }
@@ -460,8 +1536,8 @@ PG_FUNCTION_INFO_V1(email_gt);
 Datum
 email_gt(PG_FUNCTION_ARGS)
 {
-	EmailAddress    *a = (EmailAddress *) PG_GETARG_POINTER(0);
-	EmailAddress    *b = (EmailAddress *) PG_GETARG_POINTER(1);
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
 
 	PG_RETURN_BOOL(email_cmp_internal(a, b) > 0);
 }
@@ -471,36 +1547,191 @@ PG_FUNCTION_INFO_V1(email_cmp);
 Datum
 email_cmp(PG_FUNCTION_ARGS)
 {
-	EmailAddress    *a = (EmailAddress *) PG_GETARG_POINTER(0);
-	EmailAddress    *b = (EmailAddress *) PG_GETARG_POINTER(1);
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
 
 	PG_RETURN_INT32(email_cmp_internal(a, b));
 }
 
 
-/* The Not Equal function <> */
-
-PG_FUNCTION_INFO_V1(email_ne);
+/*
+ * Sort support.  The comparator calls email_cmp_internal directly instead
+ * of going through fmgr, and when the sort allows it the values are
+ * abbreviated to a Datum that holds a case folded prefix of the sort key
+ *
+ *     slot local                   for a dictionary domain
+ *     slot domain '\0' local       for any other
+ *
+ * packed big-endian, so that comparing abbreviations as unsigned integers
+ * agrees with email_cmp_internal.  The slot byte comes from
+ * email_domain_slot and already orders the domains against the
+ * dictionary, so rows of a dictionary domain spend the rest of the Datum
+ * on their local part; otherwise a column that is mostly gmail.com would
+ * abbreviate to one value and the sort would give up on abbreviation.
+ * The '\0' sorts below every character that can appear in an address,
+ * which keeps a shorter domain ahead of any longer one it is a prefix of.
+ *
+ * CREATE INDEX hands these to tuplesort, in every parallel worker as
+ * well, so the same keys bound a serial and a parallel build.
+ */
 
-Datum
-email_ne(PG_FUNCTION_ARGS)
+typedef struct EmailSortSupport
 {
-	EmailAddress    *a = (EmailAddress *) PG_GETARG_POINTER(0);
-	EmailAddress    *b = (EmailAddress *) PG_GETARG_POINTER(1);
+	int64		input_count;         // number of values abbreviated so far
+	bool		estimating;          // still checking for poor abbreviations?
+	hyperLogLogState abbr_card;      // cardinality of the abbreviated keys
+}	EmailSortSupport;
 
-	PG_RETURN_BOOL(email_cmp_internal(a, b) != 0);
+static int
+email_fastcmp(Datum x, Datum y, SortSupport ssup)
+{
+	EmailAddress    *a = (EmailAddress *) PG_DETOAST_DATUM_PACKED(x);
+	EmailAddress    *b = (EmailAddress *) PG_DETOAST_DATUM_PACKED(y);
+	int			result = email_cmp_internal(a, b);
+
+	if ((Pointer) a != DatumGetPointer(x))
+		pfree(a);
+	if ((Pointer) b != DatumGetPointer(y))
+		pfree(b);
+	return result;
 }
 
+#if PG_VERSION_NUM >= 90500
 
-/* The domain equal function ~ */
+static int
+email_abbrev_cmp(Datum x, Datum y, SortSupport ssup)
+{
+	if (x > y)
+		return 1;
+	if (x < y)
+		return -1;
+	return 0;
+}
 
-PG_FUNCTION_INFO_V1(email_de);
+static Datum
+email_abbrev_convert(Datum original, SortSupport ssup)
+{
+	EmailSortSupport *ess = (EmailSortSupport *) ssup->ssup_extra;
+	EmailAddress    *email = (EmailAddress *) PG_DETOAST_DATUM_PACKED(original);
+	EmailParts	parts;
+	Datum		res;
+	uint32		hash;
+	int			slot, skip, i;
+
+	email_unpack(email, &parts);
+	if (parts.domain_id)
+		slot = 2 * parts.domain_id - 1;
+	else
+		slot = email_domain_slot(parts.domain, parts.domain_len);
+
+	// a dictionary domain is settled by its slot, others still need their bytes
+	skip = (slot & 1) ? -1 : parts.domain_len;
+	res = (Datum) slot;
+	for (i = 0; i < SIZEOF_DATUM - 1; i++) {
+		unsigned char c = 0;
+
+		if (i < skip)
+			c = ASCII_TOLOWER((unsigned char) parts.domain[i]);
+		else if (i > skip && i - skip - 1 < parts.local_len)
+			c = ASCII_TOLOWER((unsigned char) parts.local[i - skip - 1]);
+		res = (res << 8) | c;
+	}
+
+	ess->input_count += 1;
+	if (ess->estimating) {
+#if SIZEOF_DATUM == 8
+		hash = DatumGetUInt32(hash_uint32((uint32) (res ^ (res >> 32))));
+#else
+		hash = DatumGetUInt32(hash_uint32((uint32) res));
+#endif
+		addHyperLogLog(&ess->abbr_card, hash);
+	}
+
+	if ((Pointer) email != DatumGetPointer(original))
+		pfree(email);
+	return res;
+}
+
+/**
+   Gives up on abbreviation when the keys turn out to be mostly equal,
+   e.g. a column where nearly every row shares a handful of long domains.
+   Same heuristic as the uuid opclass uses.
+*/
+static bool
+email_abbrev_abort(int memtupcount, SortSupport ssup)
+{
+	EmailSortSupport *ess = (EmailSortSupport *) ssup->ssup_extra;
+	double		abbr_card;
+
+	if (memtupcount < 10000 || ess->input_count < 10000 || !ess->estimating)
+		return false;
+
+	abbr_card = estimateHyperLogLog(&ess->abbr_card);
+
+	// plenty of distinct keys, abbreviation is clearly paying off
+	if (abbr_card > 100000.0) {
+		ess->estimating = false;
+		return false;
+	}
+
+	return abbr_card < ess->input_count / 2000.0 + 0.5;
+}
+
+#endif							/* PG_VERSION_NUM >= 90500 */
+
+PG_FUNCTION_INFO_V1(email_sortsupport);
+
+Datum
+email_sortsupport(PG_FUNCTION_ARGS)
+{
+	SortSupport ssup = (SortSupport) PG_GETARG_POINTER(0);
+
+	ssup->comparator = email_fastcmp;
+#if PG_VERSION_NUM >= 90500
+	if (ssup->abbreviate) {
+		EmailSortSupport *ess;
+		MemoryContext oldcontext = MemoryContextSwitchTo(ssup->ssup_cxt);
+
+		ess = (EmailSortSupport *) palloc(sizeof(EmailSortSupport));
+		ess->input_count = 0;
+		ess->estimating = true;
+		initHyperLogLog(&ess->abbr_card, 10);
+		MemoryContextSwitchTo(oldcontext);
+
+		ssup->ssup_extra = ess;
+		ssup->comparator = email_abbrev_cmp;
+		ssup->abbrev_converter = email_abbrev_convert;
+		ssup->abbrev_abort = email_abbrev_abort;
+		ssup->abbrev_full_comparator = email_fastcmp;
+	}
+#endif
+	PG_RETURN_VOID();
+}
+
+
+/* The Not Equal function <> */
+
+PG_FUNCTION_INFO_V1(email_ne);
+
+Datum
+email_ne(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_BOOL(email_cmp_internal(a, b) != 0);
+}
+
+
+/* The domain equal function ~ */
+
+PG_FUNCTION_INFO_V1(email_de);
 
 Datum
 email_de(PG_FUNCTION_ARGS)
 {
-	EmailAddress    *a = (EmailAddress *) PG_GETARG_POINTER(0);
-	EmailAddress    *b = (EmailAddress *) PG_GETARG_POINTER(1);
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
 
 	PG_RETURN_BOOL(domain_cmp_internal(a, b) == 0);
 }
@@ -512,11 +1743,2034 @@ PG_FUNCTION_INFO_V1(email_dne);
 Datum
 email_dne(PG_FUNCTION_ARGS)
 {
-	EmailAddress    *a = (EmailAddress *) PG_GETARG_POINTER(0);
-	EmailAddress    *b = (EmailAddress *) PG_GETARG_POINTER(1);
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
 
 	PG_RETURN_BOOL(domain_cmp_internal(a, b) != 0);
 }
 
 
+/*****************************************************************************
+ * Index support for the domain operators
+ *
+ * email_ops orders by domain first, so all the addresses in one domain sit
+ * in a single contiguous range of a btree index.  The planner support
+ * function of email_de turns "x ~ const" into
+ *
+ *     x >= (domain, '')  AND  x < (domain || '\001', '')
+ *
+ * The empty local part sorts before every real one, and no valid domain
+ * falls between a domain and the same domain with '\001' appended, so the
+ * range holds exactly the addresses in the domain.
+ *****************************************************************************/
+
+#if PG_VERSION_NUM >= 120000
+
+/**
+   Builds "indexkey >= lo AND indexkey < hi" with the operators of a btree
+   opfamily.  The range only makes sense in one particular ordering, so the
+   opfamily's < operator must be implemented by lt_proc.
+   @RETURN: the list of the two clauses, or NIL if the opfamily is not the
+            expected one.
+*/
+static List *
+email_btree_range(Oid opfamily, PGFunction lt_proc, Expr *indexkey,
+                  EmailAddress *lo, EmailAddress *hi)
+{
+	Oid			typid = exprType((Node *) indexkey);
+	Oid			ge_op = get_opfamily_member(opfamily, typid, typid,
+	                                        BTGreaterEqualStrategyNumber);
+	Oid			lt_op = get_opfamily_member(opfamily, typid, typid,
+	                                        BTLessStrategyNumber);
+	FmgrInfo	lt_info;
+	Expr	   *ge, *lt;
+
+	if (!OidIsValid(ge_op) || !OidIsValid(lt_op))
+		return NIL;
+	fmgr_info(get_opcode(lt_op), &lt_info);
+	if (lt_info.fn_addr != lt_proc)
+		return NIL;
+
+	ge = make_opclause(ge_op, BOOLOID, false, indexkey,
+	                   (Expr *) makeConst(typid, -1, InvalidOid, -1,
+	                                      PointerGetDatum(lo), false, false),
+	                   InvalidOid, InvalidOid);
+	lt = make_opclause(lt_op, BOOLOID, false, indexkey,
+	                   (Expr *) makeConst(typid, -1, InvalidOid, -1,
+	                                      PointerGetDatum(hi), false, false),
+	                   InvalidOid, InvalidOid);
+	return list_make2(ge, lt);
+}
+
+/**
+   The btree range of a domain, as described above.
+*/
+static void
+email_domain_bounds(EmailParts *parts, EmailAddress **lo, EmailAddress **hi)
+{
+	char		upper[MAX_CHARS + 1];
+
+	memcpy(upper, parts->domain, parts->domain_len);
+	upper[parts->domain_len] = '\001';
+	*lo = email_pack("", 0, parts->domain, parts->domain_len, 0);
+	*hi = email_pack("", 0, upper, parts->domain_len + 1, 0);
+}
+
+#endif							/* PG_VERSION_NUM >= 120000 */
+
+PG_FUNCTION_INFO_V1(email_de_support);
+
+Datum
+email_de_support(PG_FUNCTION_ARGS)
+{
+	Node	   *ret = NULL;
+#if PG_VERSION_NUM >= 120000
+	Node	   *rawreq = (Node *) PG_GETARG_POINTER(0);
+
+	if (IsA(rawreq, SupportRequestIndexCondition)) {
+		SupportRequestIndexCondition *req = (SupportRequestIndexCondition *) rawreq;
+		OpExpr	   *clause = (OpExpr *) req->node;
+		Expr	   *indexkey;
+		Node	   *other;
+
+		if (!is_opclause(clause) || list_length(clause->args) != 2 ||
+			req->index->relam != BTREE_AM_OID)
+			PG_RETURN_POINTER(NULL);
+
+		// ~ is its own commutator, the index key may be on either side
+		indexkey = (Expr *) list_nth(clause->args, req->indexarg);
+		other = (Node *) list_nth(clause->args, 1 - req->indexarg);
+		if (IsA(other, Const) && !((Const *) other)->constisnull) {
+			EmailParts	parts;
+			EmailAddress *lo, *hi;
+
+			email_unpack((EmailAddress *) PG_DETOAST_DATUM_PACKED(((Const *) other)->constvalue),
+			             &parts);
+			email_domain_bounds(&parts, &lo, &hi);
+			ret = (Node *) email_btree_range(req->opfamily, email_lt, indexkey, lo, hi);
+			// keep ~ as a recheck, it is cheap and guards odd binary input
+			req->lossy = true;
+		}
+	}
+#endif
+	PG_RETURN_POINTER(ret);
+}
+
+
+/*****************************************************************************
+ * Statistics
+ *
+ * email_typanalyze runs the standard ANALYZE for the type and then adds
+ * two slots of its own, both with the domains lower cased as text:
+ *
+ *   EMAIL_STATISTIC_KIND_DOMAIN_MCV: the most common domains and their
+ *     frequencies, like a STATISTIC_KIND_MCV slot.  Two more numbers
+ *     follow the frequencies: the estimated number of distinct domains
+ *     in the column and the average length of the local parts.
+ *   EMAIL_STATISTIC_KIND_DOMAIN_HISTOGRAM: a histogram of the other
+ *     domains, in email_ops domain order, each bound standing for the
+ *     same share of their rows.  The <@ estimate counts the bounds that
+ *     lie within the queried domain.
+ *
+ * The kind numbers are outside the range that core and the well known
+ * extensions use.  A slot is only left out when the standard statistics
+ * have already taken all but one of them.
+ *****************************************************************************/
+
+#define EMAIL_STATISTIC_KIND_DOMAIN_MCV        4701
+#define EMAIL_STATISTIC_KIND_DOMAIN_HISTOGRAM  4702
+
+/* What std_typanalyze set up, run before the domain statistics */
+typedef struct EmailAnalyzeData
+{
+	AnalyzeAttrComputeStatsFunc std_compute_stats;
+	void	   *std_extra_data;
+}	EmailAnalyzeData;
+
+/* A domain of the sample, pointing into the sample row */
+typedef struct DomainCount
+{
+	const char *domain;
+	int			len;
+	int			count;
+}	DomainCount;
+
+static int
+domain_count_name_cmp(const void *a, const void *b)
+{
+	const DomainCount *x = (const DomainCount *) a;
+	const DomainCount *y = (const DomainCount *) b;
+
+	return parts_casecmp(x->domain, x->len, y->domain, y->len);
+}
+
+static int
+domain_count_freq_cmp(const void *a, const void *b)
+{
+	const DomainCount *x = (const DomainCount *) a;
+	const DomainCount *y = (const DomainCount *) b;
+
+	if (x->count != y->count)
+		return y->count - x->count;
+	return domain_count_name_cmp(a, b);
+}
+
+static Datum
+domain_text(const DomainCount *dc)
+{
+	text	   *result = (text *) palloc(VARHDRSZ + dc->len);
+	int			i;
+
+	SET_VARSIZE(result, VARHDRSZ + dc->len);
+	for (i = 0; i < dc->len; i++)
+		VARDATA(result)[i] = ASCII_TOLOWER((unsigned char) dc->domain[i]);
+	return PointerGetDatum(result);
+}
+
+static void
+email_compute_stats(VacAttrStats *stats, AnalyzeAttrFetchFunc fetchfunc,
+                    int samplerows, double totalrows)
+{
+	EmailAnalyzeData *data = (EmailAnalyzeData *) stats->extra_data;
+	DomainCount *domains;
+	MemoryContext old_context;
+	Datum	   *values;
+	float4	   *numbers;
+	double		local_total = 0.0, ndistinct;
+	int			nonnull = 0, ndomains = 0, nsingle = 0;
+	int			target, nmcv, nhist, rest_rows = 0, seen = 0;
+	int			slot, i, j;
+
+	stats->extra_data = data->std_extra_data;
+	data->std_compute_stats(stats, fetchfunc, samplerows, totalrows);
+	stats->extra_data = data;
+
+	for (slot = 0; slot < STATISTIC_NUM_SLOTS && stats->stakind[slot] != 0; slot++)
+		;
+	if (!stats->stats_valid || slot == STATISTIC_NUM_SLOTS)
+		return;
+#if PG_VERSION_NUM >= 170000
+	target = stats->attstattarget;
+#else
+	target = stats->attr->attstattarget;
+#endif
+	if (target < 0)
+		target = default_statistics_target;
+
+	domains = (DomainCount *) palloc(sizeof(DomainCount) * samplerows);
+	for (i = 0; i < samplerows; i++) {
+		bool		isnull;
+		Datum		value = fetchfunc(stats, i, &isnull);
+		EmailParts	parts;
+
+		if (isnull)
+			continue;
+		email_unpack((EmailAddress *) PG_DETOAST_DATUM_PACKED(value), &parts);
+		domains[nonnull].domain = parts.domain;
+		domains[nonnull].len = parts.domain_len;
+		domains[nonnull].count = 1;
+		local_total += parts.local_len;
+		nonnull++;
+	}
+	if (nonnull == 0)
+		return;
+
+	// collapse the sample into distinct domains with their counts
+	qsort(domains, nonnull, sizeof(DomainCount), domain_count_name_cmp);
+	for (i = 1, ndomains = 1; i < nonnull; i++) {
+		if (domain_count_name_cmp(&domains[i], &domains[ndomains - 1]) == 0)
+			domains[ndomains - 1].count++;
+		else
+			domains[ndomains++] = domains[i];
+	}
+	for (i = 0; i < ndomains; i++) {
+		if (domains[i].count == 1)
+			nsingle++;
+	}
+
+	// the Haas and Stokes estimator, as compute_scalar_stats uses it
+	if (nsingle == ndomains)
+		ndistinct = totalrows * nonnull / samplerows;
+	else {
+		double		n = nonnull;
+		double		N = totalrows * nonnull / samplerows;
+
+		ndistinct = n * ndomains / ((n - nsingle) + nsingle * n / N);
+		ndistinct = Max(ndistinct, ndomains);
+		ndistinct = Min(ndistinct, N);
+	}
+
+	// keep every domain if they all fit, else the ones seen more than once
+	qsort(domains, ndomains, sizeof(DomainCount), domain_count_freq_cmp);
+	if (ndomains <= target && nsingle < ndomains)
+		nmcv = ndomains;
+	else
+		for (nmcv = 0; nmcv < Min(ndomains, target) && domains[nmcv].count > 1; nmcv++)
+			;
+
+	old_context = MemoryContextSwitchTo(stats->anl_context);
+	values = (Datum *) palloc(sizeof(Datum) * Max(nmcv, 1));
+	numbers = (float4 *) palloc(sizeof(float4) * (nmcv + 2));
+	for (i = 0; i < nmcv; i++) {
+		values[i] = domain_text(&domains[i]);
+		numbers[i] = (float4) domains[i].count / (float4) samplerows;
+	}
+	numbers[nmcv] = (float4) ndistinct;
+	numbers[nmcv + 1] = (float4) (local_total / nonnull);
+
+	stats->stakind[slot] = EMAIL_STATISTIC_KIND_DOMAIN_MCV;
+	stats->staop[slot] = InvalidOid;
+#if PG_VERSION_NUM >= 120000
+	stats->stacoll[slot] = InvalidOid;
+#endif
+	stats->stanumbers[slot] = numbers;
+	stats->numnumbers[slot] = nmcv + 2;
+	stats->stavalues[slot] = values;
+	stats->numvalues[slot] = nmcv;
+	stats->statypid[slot] = TEXTOID;
+	stats->statyplen[slot] = -1;
+	stats->statypbyval[slot] = false;
+	stats->statypalign[slot] = 'i';
+	MemoryContextSwitchTo(old_context);
+
+	// a histogram of the remaining domains, each weighted by its rows
+	for (i = nmcv; i < ndomains; i++)
+		rest_rows += domains[i].count;
+	if (++slot < STATISTIC_NUM_SLOTS && ndomains - nmcv >= 2) {
+		qsort(domains + nmcv, ndomains - nmcv, sizeof(DomainCount),
+		      domain_count_name_cmp);
+		nhist = Min(ndomains - nmcv, target + 1);
+
+		old_context = MemoryContextSwitchTo(stats->anl_context);
+		values = (Datum *) palloc(sizeof(Datum) * nhist);
+		for (i = 0, j = nmcv; i < nhist; i++) {
+			int			pos = (int) ((double) i * (rest_rows - 1) / (nhist - 1));
+
+			// step on to the domain that holds row pos of the rest
+			while (seen + domains[j].count <= pos)
+				seen += domains[j++].count;
+			values[i] = domain_text(&domains[j]);
+		}
+
+		stats->stakind[slot] = EMAIL_STATISTIC_KIND_DOMAIN_HISTOGRAM;
+		stats->staop[slot] = InvalidOid;
+#if PG_VERSION_NUM >= 120000
+		stats->stacoll[slot] = InvalidOid;
+#endif
+		stats->stavalues[slot] = values;
+		stats->numvalues[slot] = nhist;
+		stats->statypid[slot] = TEXTOID;
+		stats->statyplen[slot] = -1;
+		stats->statypbyval[slot] = false;
+		stats->statypalign[slot] = 'i';
+		MemoryContextSwitchTo(old_context);
+	}
+	pfree(domains);
+}
+
+PG_FUNCTION_INFO_V1(email_typanalyze);
+
+Datum
+email_typanalyze(PG_FUNCTION_ARGS)
+{
+	VacAttrStats *stats = (VacAttrStats *) PG_GETARG_POINTER(0);
+	EmailAnalyzeData *data;
+
+	if (!std_typanalyze(stats))
+		PG_RETURN_BOOL(false);
+
+	data = (EmailAnalyzeData *) palloc(sizeof(EmailAnalyzeData));
+	data->std_compute_stats = stats->compute_stats;
+	data->std_extra_data = stats->extra_data;
+	stats->compute_stats = email_compute_stats;
+	stats->extra_data = data;
+	PG_RETURN_BOOL(true);
+}
+
+/*****************************************************************************
+ * Selectivity of the domain operators
+ *
+ * Estimating ~ with eqsel treats it as equality of whole addresses, which
+ * is off by about the number of addresses per domain.  With the domain
+ * statistics of email_typanalyze the estimate is that of the domain: its
+ * MCV frequency, or else an even share of what the MCVs leave over, and
+ * for joins the eqjoinsel formula applied to domains.  Columns analyzed
+ * without them fall back on running the operator itself over the MCV
+ * list and histogram, and for joins on matching up the two MCV lists.
+ * <@ is estimated the same way: the MCV domains within the queried one,
+ * plus the part of the domain histogram that is.
+ * Needs PostgreSQL 13 or later; older servers get the defaults.
+ *****************************************************************************/
+
+// the share of rows taken to be at any one given domain
+#define DEFAULT_DOMAIN_SEL  0.01
+
+#if PG_VERSION_NUM >= 130000
+
+/* The EMAIL_STATISTIC_KIND_DOMAIN_MCV slot of a column */
+typedef struct EmailDomainStats
+{
+	AttStatsSlot sslot;
+	int			nmcv;                // number of domains in sslot
+	double		mcv_sum;             // their total frequency
+	double		nullfrac;
+	double		ndistinct;           // distinct domains in the column
+	double		avg_local_len;
+}	EmailDomainStats;
+
+static bool
+email_get_domain_stats(VariableStatData *vardata, EmailDomainStats *ds)
+{
+	int			i;
+
+	if (!HeapTupleIsValid(vardata->statsTuple) ||
+		!get_attstatsslot(&ds->sslot, vardata->statsTuple,
+		                  EMAIL_STATISTIC_KIND_DOMAIN_MCV, InvalidOid,
+		                  ATTSTATSSLOT_NUMBERS))
+		return false;
+	ds->nmcv = ds->sslot.nnumbers - 2;
+	if (ds->nmcv < 0) {
+		free_attstatsslot(&ds->sslot);
+		return false;
+	}
+	// the values are stored as NULL when there are none
+	if (ds->nmcv > 0) {
+		free_attstatsslot(&ds->sslot);
+		if (!get_attstatsslot(&ds->sslot, vardata->statsTuple,
+		                      EMAIL_STATISTIC_KIND_DOMAIN_MCV, InvalidOid,
+		                      ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS))
+			return false;
+	}
+
+	ds->mcv_sum = 0.0;
+	for (i = 0; i < ds->nmcv; i++)
+		ds->mcv_sum += ds->sslot.numbers[i];
+	ds->ndistinct = Max(ds->sslot.numbers[ds->nmcv], ds->nmcv);
+	ds->avg_local_len = ds->sslot.numbers[ds->nmcv + 1];
+	ds->nullfrac = ((Form_pg_statistic) GETSTRUCT(vardata->statsTuple))->stanullfrac;
+	return true;
+}
+
+static bool
+domain_stats_value_eq(Datum a, Datum b)
+{
+	text	   *x = DatumGetTextPP(a);
+	text	   *y = DatumGetTextPP(b);
+
+	// both sides were lower cased by email_compute_stats
+	return parts_memcmp(VARDATA_ANY(x), VARSIZE_ANY_EXHDR(x),
+	                    VARDATA_ANY(y), VARSIZE_ANY_EXHDR(y)) == 0;
+}
+
+/**
+   Tells whether a domain of the statistics is within a domain, as <@ has
+   it for an address.
+*/
+static bool
+domain_stats_value_within(Datum value, const char *suffix, int suffix_len)
+{
+	text	   *domain = DatumGetTextPP(value);
+	EmailParts	parts;
+
+	parts.domain = VARDATA_ANY(domain);
+	parts.domain_len = VARSIZE_ANY_EXHDR(domain);
+	return domain_is_within(&parts, suffix, suffix_len);
+}
+
+/**
+   The share of rows at a given domain.
+*/
+static double
+email_domain_freq(EmailDomainStats *ds, const char *domain, int domain_len)
+{
+	int			i;
+
+	for (i = 0; i < ds->nmcv; i++) {
+		text	   *mcv = DatumGetTextPP(ds->sslot.values[i]);
+
+		if (parts_casecmp(VARDATA_ANY(mcv), VARSIZE_ANY_EXHDR(mcv),
+		                  domain, domain_len) == 0)
+			return ds->sslot.numbers[i];
+	}
+	return (1.0 - ds->nullfrac - ds->mcv_sum) / Max(ds->ndistinct - ds->nmcv, 1.0);
+}
+
+/**
+   The eqjoinsel_inner estimate, over domains instead of values.
+*/
+static double
+email_domain_stats_joinsel(EmailDomainStats *ds1, EmailDomainStats *ds2)
+{
+	bool	   *matched2 = (bool *) palloc0(sizeof(bool) * Max(ds2->nmcv, 1));
+	double		matchprod = 0.0, matchfreq1 = 0.0, matchfreq2 = 0.0;
+	double		unmatch1, unmatch2, other1, other2, sel1, sel2;
+	int			nmatches = 0, i, j;
+
+	for (i = 0; i < ds1->nmcv; i++) {
+		for (j = 0; j < ds2->nmcv; j++) {
+			if (!matched2[j] &&
+				domain_stats_value_eq(ds1->sslot.values[i], ds2->sslot.values[j])) {
+				matchprod += ds1->sslot.numbers[i] * ds2->sslot.numbers[j];
+				matchfreq1 += ds1->sslot.numbers[i];
+				matchfreq2 += ds2->sslot.numbers[j];
+				matched2[j] = true;
+				nmatches++;
+				break;
+			}
+		}
+	}
+	pfree(matched2);
+
+	unmatch1 = ds1->mcv_sum - matchfreq1;
+	unmatch2 = ds2->mcv_sum - matchfreq2;
+	other1 = Max(1.0 - ds1->nullfrac - ds1->mcv_sum, 0.0);
+	other2 = Max(1.0 - ds2->nullfrac - ds2->mcv_sum, 0.0);
+
+	sel1 = sel2 = matchprod;
+	if (ds2->ndistinct > ds2->nmcv)
+		sel1 += unmatch1 * other2 / (ds2->ndistinct - ds2->nmcv);
+	if (ds2->ndistinct > nmatches)
+		sel1 += other1 * (other2 + unmatch2) / (ds2->ndistinct - nmatches);
+	if (ds1->ndistinct > ds1->nmcv)
+		sel2 += unmatch2 * other1 / (ds1->ndistinct - ds1->nmcv);
+	if (ds1->ndistinct > nmatches)
+		sel2 += other2 * (other1 + unmatch1) / (ds1->ndistinct - nmatches);
+	return Min(sel1, sel2);
+}
+
+/**
+   Estimates the share of rows that are at (or not at) a domain.
+*/
+static double
+email_domain_restrictsel(PlannerInfo *root, Oid operator, Oid collation,
+                         List *args, int varRelid, bool negate)
+{
+	VariableStatData vardata;
+	Node	   *other;
+	bool		varonleft;
+	EmailDomainStats ds;
+	double		selec;
+
+	if (get_restriction_variable(root, args, varRelid, &vardata, &other, &varonleft)) {
+		if (IsA(other, Const) && !((Const *) other)->constisnull &&
+			email_get_domain_stats(&vardata, &ds)) {
+			EmailParts	parts;
+
+			email_unpack((EmailAddress *) PG_DETOAST_DATUM_PACKED(((Const *) other)->constvalue),
+			             &parts);
+			selec = email_domain_freq(&ds, parts.domain, parts.domain_len);
+			if (negate)
+				selec = 1.0 - ds.nullfrac - selec;
+			free_attstatsslot(&ds.sslot);
+			ReleaseVariableStats(vardata);
+			CLAMP_PROBABILITY(selec);
+			return selec;
+		}
+		ReleaseVariableStats(vardata);
+	}
+	return generic_restriction_selectivity(root, operator, collation, args, varRelid,
+	                                       negate ? 1.0 - DEFAULT_DOMAIN_SEL : DEFAULT_DOMAIN_SEL);
+}
+
+/**
+   Estimates the share of non null row pairs at the same domain from the
+   whole address MCV lists, for columns without domain statistics.
+*/
+static double
+email_mcv_domain_joinsel(VariableStatData *vardata1, VariableStatData *vardata2,
+                         double pairs)
+{
+	AttStatsSlot sslot1, sslot2;
+	double		sum1 = 0.0, sum2 = 0.0, matched = 0.0;
+	double		selec = DEFAULT_DOMAIN_SEL * pairs;
+	int			i, j;
+
+	if (!HeapTupleIsValid(vardata1->statsTuple) ||
+		!HeapTupleIsValid(vardata2->statsTuple) ||
+		!get_attstatsslot(&sslot1, vardata1->statsTuple, STATISTIC_KIND_MCV,
+		                  InvalidOid, ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS))
+		return selec;
+	if (get_attstatsslot(&sslot2, vardata2->statsTuple, STATISTIC_KIND_MCV,
+	                     InvalidOid, ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS)) {
+		for (i = 0; i < sslot1.nnumbers; i++)
+			sum1 += sslot1.numbers[i];
+		for (j = 0; j < sslot2.nnumbers; j++)
+			sum2 += sslot2.numbers[j];
+
+		// MCV pairs are known exactly, the other pairs meet at the default rate
+		for (i = 0; i < sslot1.nvalues; i++) {
+			EmailAddress *a = (EmailAddress *) PG_DETOAST_DATUM_PACKED(sslot1.values[i]);
+
+			for (j = 0; j < sslot2.nvalues; j++) {
+				if (domain_cmp_internal(a, (EmailAddress *) PG_DETOAST_DATUM_PACKED(sslot2.values[j])) == 0)
+					matched += sslot1.numbers[i] * sslot2.numbers[j];
+			}
+		}
+		selec = matched + (pairs - sum1 * sum2) * DEFAULT_DOMAIN_SEL;
+		free_attstatsslot(&sslot2);
+	}
+	free_attstatsslot(&sslot1);
+	return selec;
+}
+
+/**
+   Estimates the share of row pairs that are at the same domain.
+   @PARAMS vardata1, vardata2: the statistics of the two sides.
+           negate: estimate !~ instead.
+   @RETURN: the selectivity.
+*/
+static double
+email_domain_joinsel(VariableStatData *vardata1, VariableStatData *vardata2,
+                     bool negate)
+{
+	EmailDomainStats ds1, ds2;
+	double		nullfrac1 = 0.0, nullfrac2 = 0.0;
+	double		pairs, selec = -1.0;
+
+	if (HeapTupleIsValid(vardata1->statsTuple))
+		nullfrac1 = ((Form_pg_statistic) GETSTRUCT(vardata1->statsTuple))->stanullfrac;
+	if (HeapTupleIsValid(vardata2->statsTuple))
+		nullfrac2 = ((Form_pg_statistic) GETSTRUCT(vardata2->statsTuple))->stanullfrac;
+	pairs = (1.0 - nullfrac1) * (1.0 - nullfrac2);
+
+	if (email_get_domain_stats(vardata1, &ds1)) {
+		if (email_get_domain_stats(vardata2, &ds2)) {
+			selec = email_domain_stats_joinsel(&ds1, &ds2);
+			free_attstatsslot(&ds2.sslot);
+		}
+		free_attstatsslot(&ds1.sslot);
+	}
+	if (selec < 0.0)
+		selec = email_mcv_domain_joinsel(vardata1, vardata2, pairs);
+
+	if (negate)
+		selec = pairs - selec;
+	CLAMP_PROBABILITY(selec);
+	return selec;
+}
+
+#endif							/* PG_VERSION_NUM >= 130000 */
+
+PG_FUNCTION_INFO_V1(email_de_sel);
+
+Datum
+email_de_sel(PG_FUNCTION_ARGS)
+{
+	double		selec = DEFAULT_DOMAIN_SEL;
+#if PG_VERSION_NUM >= 130000
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	Oid			operator = PG_GETARG_OID(1);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	int			varRelid = PG_GETARG_INT32(3);
+
+	selec = email_domain_restrictsel(root, operator, PG_GET_COLLATION(),
+	                                 args, varRelid, false);
+#endif
+	PG_RETURN_FLOAT8(selec);
+}
+
+PG_FUNCTION_INFO_V1(email_dne_sel);
+
+Datum
+email_dne_sel(PG_FUNCTION_ARGS)
+{
+	double		selec = 1.0 - DEFAULT_DOMAIN_SEL;
+#if PG_VERSION_NUM >= 130000
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	Oid			operator = PG_GETARG_OID(1);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	int			varRelid = PG_GETARG_INT32(3);
+
+	selec = email_domain_restrictsel(root, operator, PG_GET_COLLATION(),
+	                                 args, varRelid, true);
+#endif
+	PG_RETURN_FLOAT8(selec);
+}
+
+/**
+   Estimates the share of rows within a domain, for <@.
+*/
+PG_FUNCTION_INFO_V1(email_within_sel);
+
+Datum
+email_within_sel(PG_FUNCTION_ARGS)
+{
+	double		selec = DEFAULT_DOMAIN_SEL;
+#if PG_VERSION_NUM >= 130000
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	Oid			operator = PG_GETARG_OID(1);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	int			varRelid = PG_GETARG_INT32(3);
+	VariableStatData vardata;
+	Node	   *other;
+	bool		varonleft;
+	EmailDomainStats ds;
+
+	if (!get_restriction_variable(root, args, varRelid, &vardata, &other, &varonleft))
+		PG_RETURN_FLOAT8(selec);
+	if (varonleft && IsA(other, Const) && !((Const *) other)->constisnull &&
+		email_get_domain_stats(&vardata, &ds)) {
+		text	   *suffix = DatumGetTextPP(((Const *) other)->constvalue);
+		AttStatsSlot hist;
+		double		rest = Max(1.0 - ds.nullfrac - ds.mcv_sum, 0.0);
+		int			i, n = 0;
+
+		selec = 0.0;
+		for (i = 0; i < ds.nmcv; i++) {
+			if (domain_stats_value_within(ds.sslot.values[i], VARDATA_ANY(suffix),
+			                              VARSIZE_ANY_EXHDR(suffix)))
+				selec += ds.sslot.numbers[i];
+		}
+		// the histogram bounds split the other rows evenly
+		if (get_attstatsslot(&hist, vardata.statsTuple,
+		                     EMAIL_STATISTIC_KIND_DOMAIN_HISTOGRAM, InvalidOid,
+		                     ATTSTATSSLOT_VALUES)) {
+			for (i = 0; i < hist.nvalues; i++) {
+				if (domain_stats_value_within(hist.values[i], VARDATA_ANY(suffix),
+				                              VARSIZE_ANY_EXHDR(suffix)))
+					n++;
+			}
+			selec += rest * n / hist.nvalues;
+			free_attstatsslot(&hist);
+		}
+		else if (ds.ndistinct > ds.nmcv)
+			selec += rest * DEFAULT_DOMAIN_SEL;
+		free_attstatsslot(&ds.sslot);
+		ReleaseVariableStats(vardata);
+		CLAMP_PROBABILITY(selec);
+		PG_RETURN_FLOAT8(selec);
+	}
+	ReleaseVariableStats(vardata);
+	selec = generic_restriction_selectivity(root, operator, PG_GET_COLLATION(),
+	                                        args, varRelid, DEFAULT_DOMAIN_SEL);
+#endif
+	PG_RETURN_FLOAT8(selec);
+}
+
+PG_FUNCTION_INFO_V1(email_de_joinsel);
+
+Datum
+email_de_joinsel(PG_FUNCTION_ARGS)
+{
+	double		selec = DEFAULT_DOMAIN_SEL;
+#if PG_VERSION_NUM >= 130000
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	SpecialJoinInfo *sjinfo = (SpecialJoinInfo *) PG_GETARG_POINTER(4);
+	VariableStatData vardata1, vardata2;
+	bool		join_is_reversed;
+
+	get_join_variables(root, args, sjinfo, &vardata1, &vardata2, &join_is_reversed);
+	selec = email_domain_joinsel(&vardata1, &vardata2, false);
+	ReleaseVariableStats(vardata1);
+	ReleaseVariableStats(vardata2);
+#endif
+	PG_RETURN_FLOAT8(selec);
+}
+
+PG_FUNCTION_INFO_V1(email_dne_joinsel);
+
+Datum
+email_dne_joinsel(PG_FUNCTION_ARGS)
+{
+	double		selec = 1.0 - DEFAULT_DOMAIN_SEL;
+#if PG_VERSION_NUM >= 130000
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	SpecialJoinInfo *sjinfo = (SpecialJoinInfo *) PG_GETARG_POINTER(4);
+	VariableStatData vardata1, vardata2;
+	bool		join_is_reversed;
+
+	get_join_variables(root, args, sjinfo, &vardata1, &vardata2, &join_is_reversed);
+	selec = email_domain_joinsel(&vardata1, &vardata2, true);
+	ReleaseVariableStats(vardata1);
+	ReleaseVariableStats(vardata2);
+#endif
+	PG_RETURN_FLOAT8(selec);
+}
+
+/*****************************************************************************
+ * Reversed domain ordering
+ *
+ * email_rdomain_ops is a second btree opclass that orders by the domain
+ * labels read from the right (au, edu, unsw, cse for cse.unsw.edu.au),
+ * then by local part.  Every domain is then directly followed by all of
+ * its subdomains, so "x <@ 'unsw.edu.au'" (x is in unsw.edu.au or one of
+ * its subdomains) is a single range of such an index:
+ *
+ *     x ~>=~ ('unsw.edu.au', '')  AND  x ~<~ ('unsw\001.edu.au', '')
+ *
+ * Labels are compared like parts, with the end of a label sorting lowest;
+ * a domain with fewer labels sorts before a longer one it is a suffix of.
+ *****************************************************************************/
+
+/**
+   Compares two domains label by label from the right, ignoring case.
+   @RETURN: <0, 0 or >0 in the manner of strcasecmp.
+*/
+int rdomain_casecmp (const char *a, int a_len, const char *b, int b_len)
+{
+	int ae = a_len, be = b_len;   // end of the current label, -1 when done
+
+	while (ae >= 0 && be >= 0) {
+		int as = ae, bs = be;
+		int result;
+
+		while (as > 0 && a[as - 1] != '.') as--;
+		while (bs > 0 && b[bs - 1] != '.') bs--;
+		result = parts_casecmp(a + as, ae - as, b + bs, be - bs);
+		if (result != 0)
+			return result;
+		ae = as - 1;
+		be = bs - 1;
+	}
+	return (ae >= 0) - (be >= 0);
+}
+
+/**
+   Compares two EmailAddresses, reversed domain first then local.
+*/
+int email_rdomain_cmp_internal(EmailAddress * a, EmailAddress * b)
+{
+	int result;
+	EmailParts pa, pb;
+
+	email_unpack(a, &pa);
+	email_unpack(b, &pb);
+
+	result = rdomain_casecmp(pa.domain, pa.domain_len, pb.domain, pb.domain_len);
+	if (result == 0)
+		result = LOCAL_CMP(pa, pb);
+	return result;
+}
+
+/**
+   Tests whether the domain of an address is suffix, or a subdomain of it.
+   A leading '.' on the suffix is ignored.
+*/
+int domain_is_within (EmailParts *parts, const char *suffix, int suffix_len)
+{
+	int offset;
+
+	if (suffix_len > 0 && suffix[0] == '.') {
+		suffix++;
+		suffix_len--;
+	}
+	offset = parts->domain_len - suffix_len;
+	if (offset < 0)
+		return FALSE;
+	if (offset > 0 && parts->domain[offset - 1] != '.')
+		return FALSE;
+	return parts_casecmp(parts->domain + offset, suffix_len, suffix, suffix_len) == 0;
+}
+
+PG_FUNCTION_INFO_V1(email_rdomain_lt);
+
+Datum
+email_rdomain_lt(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_BOOL(email_rdomain_cmp_internal(a, b) < 0);
+}
+
+PG_FUNCTION_INFO_V1(email_rdomain_le);
+
+Datum
+email_rdomain_le(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_BOOL(email_rdomain_cmp_internal(a, b) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(email_rdomain_ge);
+
+Datum
+email_rdomain_ge(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_BOOL(email_rdomain_cmp_internal(a, b) >= 0);
+}
+
+PG_FUNCTION_INFO_V1(email_rdomain_gt);
+
+Datum
+email_rdomain_gt(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_BOOL(email_rdomain_cmp_internal(a, b) > 0);
+}
+
+PG_FUNCTION_INFO_V1(email_rdomain_cmp);
+
+Datum
+email_rdomain_cmp(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_INT32(email_rdomain_cmp_internal(a, b));
+}
 
+/**
+   Writes a domain with its labels reversed and in lower case into dst,
+   which must have room for domain_len bytes.
+   @RETURN: the number of bytes written, always domain_len.
+*/
+int reverse_domain (const char *domain, int domain_len, char *dst)
+{
+	char	   *start_dst = dst;
+	int			end, start;
+
+	for (end = domain_len; end >= 0; end = start - 1) {
+		int i;
+
+		for (start = end; start > 0 && domain[start - 1] != '.'; start--)
+			;
+		for (i = start; i < end; i++)
+			*dst++ = ASCII_TOLOWER((unsigned char) domain[i]);
+		if (start > 0)
+			*dst++ = '.';
+	}
+	return dst - start_dst;
+}
+
+/**
+   The domain of an address with its labels reversed and in lower case,
+   e.g. 'au.edu.unsw.cse' for jas@cse.unsw.edu.au.
+*/
+PG_FUNCTION_INFO_V1(email_reverse_domain);
+
+Datum
+email_reverse_domain(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	EmailParts	parts;
+	text	   *result;
+
+	email_unpack(email, &parts);
+	result = (text *) palloc(VARHDRSZ + parts.domain_len);
+	SET_VARSIZE(result, VARHDRSZ + parts.domain_len);
+	reverse_domain(parts.domain, parts.domain_len, VARDATA(result));
+	PG_RETURN_TEXT_P(result);
+}
+
+/* The within domain function <@ */
+
+PG_FUNCTION_INFO_V1(email_within);
+
+Datum
+email_within(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	text	   *suffix = PG_GETARG_TEXT_PP(1);
+	EmailParts	parts;
+
+	email_unpack(email, &parts);
+	PG_RETURN_BOOL(domain_is_within(&parts, VARDATA_ANY(suffix),
+	                                VARSIZE_ANY_EXHDR(suffix)));
+}
+
+PG_FUNCTION_INFO_V1(email_within_support);
+
+Datum
+email_within_support(PG_FUNCTION_ARGS)
+{
+	Node	   *ret = NULL;
+#if PG_VERSION_NUM >= 120000
+	Node	   *rawreq = (Node *) PG_GETARG_POINTER(0);
+
+	if (IsA(rawreq, SupportRequestIndexCondition)) {
+		SupportRequestIndexCondition *req = (SupportRequestIndexCondition *) rawreq;
+		OpExpr	   *clause = (OpExpr *) req->node;
+		Node	   *other;
+
+		// only "email <@ text" with the address as the index key
+		if (!is_opclause(clause) || list_length(clause->args) != 2 ||
+			req->indexarg != 0 || req->index->relam != BTREE_AM_OID)
+			PG_RETURN_POINTER(NULL);
+
+		other = (Node *) lsecond(clause->args);
+		if (IsA(other, Const) && !((Const *) other)->constisnull) {
+			text	   *suffix = DatumGetTextPP(((Const *) other)->constvalue);
+			const char *str = VARDATA_ANY(suffix);
+			int			len = VARSIZE_ANY_EXHDR(suffix);
+			char		upper[MAX_CHARS + 1];
+			int			first;
+
+			if (len > 0 && str[0] == '.') {
+				str++;
+				len--;
+			}
+			if (len == 0 || len >= MAX_CHARS)
+				PG_RETURN_POINTER(NULL);
+
+			// the upper bound bumps the leftmost label of the suffix
+			for (first = 0; first < len && str[first] != '.'; first++)
+				;
+			memcpy(upper, str, first);
+			upper[first] = '\001';
+			memcpy(upper + first + 1, str + first, len - first);
+
+			ret = (Node *) email_btree_range(req->opfamily, email_rdomain_lt,
+			                                 (Expr *) linitial(clause->args),
+			                                 email_pack("", 0, str, len, 0),
+			                                 email_pack("", 0, upper, len + 1, 0));
+			req->lossy = true;
+		}
+	}
+#endif
+	PG_RETURN_POINTER(ret);
+}
+
+
+/*****************************************************************************
+ * Local part prefix matching
+ *
+ * x ^@ 'j.@example.com' is true for the addresses at example.com whose
+ * local part starts with "j.", ignoring case like every other comparison.
+ *
+ * In email_ops order those addresses are one range, and the planner
+ * support function of email_starts_with turns the operator into
+ *
+ *     x >= (domain, prefix)  AND  x < (domain, prefix || '\177')
+ *
+ * A local part with the prefix is not less than the prefix itself, and
+ * is less than the prefix followed by a byte above every character a
+ * local part can have; any other local part falls outside, on the side
+ * of the first character where it differs.
+ *****************************************************************************/
+
+/**
+   Splits a "prefix@domain" pattern of the ^@ operator.  Only the strings
+   and lengths of parts are filled in.
+   @PARAMS pattern: the text to split.
+           parts: set to point into the pattern.
+*/
+void email_prefix_parse (text *pattern, EmailParts *parts)
+{
+	const char *str = VARDATA_ANY(pattern);
+	int			len = VARSIZE_ANY_EXHDR(pattern);
+	const char *at = memchr(str, '@', len);
+
+	if (at == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("email prefix pattern must have the form \"prefix@domain\": \"%.*s\"",
+				        len, str)));
+	memset(parts, 0, sizeof(EmailParts));
+	parts->local = str;
+	parts->local_len = at - str;
+	parts->domain = at + 1;
+	parts->domain_len = len - parts->local_len - 1;
+}
+
+/* The starts with function ^@ */
+
+PG_FUNCTION_INFO_V1(email_starts_with);
+
+Datum
+email_starts_with(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	text	   *pattern = PG_GETARG_TEXT_PP(1);
+	EmailParts	parts, pat;
+
+	email_unpack(email, &parts);
+	email_prefix_parse(pattern, &pat);
+	PG_RETURN_BOOL(parts.local_len >= pat.local_len &&
+	               parts_casecmp(parts.domain, parts.domain_len,
+	                             pat.domain, pat.domain_len) == 0 &&
+	               parts_casecmp(parts.local, pat.local_len,
+	                             pat.local, pat.local_len) == 0);
+}
+
+PG_FUNCTION_INFO_V1(email_starts_with_support);
+
+Datum
+email_starts_with_support(PG_FUNCTION_ARGS)
+{
+	Node	   *ret = NULL;
+#if PG_VERSION_NUM >= 120000
+	Node	   *rawreq = (Node *) PG_GETARG_POINTER(0);
+
+	if (IsA(rawreq, SupportRequestIndexCondition)) {
+		SupportRequestIndexCondition *req = (SupportRequestIndexCondition *) rawreq;
+		OpExpr	   *clause = (OpExpr *) req->node;
+		Node	   *other;
+
+		// only "email ^@ text" with the address as the index key
+		if (!is_opclause(clause) || list_length(clause->args) != 2 ||
+			req->indexarg != 0 || req->index->relam != BTREE_AM_OID)
+			PG_RETURN_POINTER(NULL);
+
+		other = (Node *) lsecond(clause->args);
+		if (IsA(other, Const) && !((Const *) other)->constisnull) {
+			text	   *pattern = DatumGetTextPP(((Const *) other)->constvalue);
+			const char *str = VARDATA_ANY(pattern);
+			EmailParts	pat;
+			char		upper[MAX_CHARS];
+
+			// a pattern without '@' is an error, leave it to email_starts_with
+			if (memchr(str, '@', VARSIZE_ANY_EXHDR(pattern)) == NULL)
+				PG_RETURN_POINTER(NULL);
+			email_prefix_parse(pattern, &pat);
+			if (pat.local_len + 1 >= MAX_CHARS || pat.domain_len >= MAX_CHARS)
+				PG_RETURN_POINTER(NULL);
+
+			memcpy(upper, pat.local, pat.local_len);
+			upper[pat.local_len] = '\177';
+			ret = (Node *) email_btree_range(req->opfamily, email_lt,
+			                                 (Expr *) linitial(clause->args),
+			                                 email_pack(pat.local, pat.local_len,
+			                                            pat.domain, pat.domain_len, 0),
+			                                 email_pack(upper, pat.local_len + 1,
+			                                            pat.domain, pat.domain_len, 0));
+			// ^@ stays as a recheck, like ~ and <@
+			req->lossy = true;
+		}
+	}
+#endif
+	PG_RETURN_POINTER(ret);
+}
+
+
+/*****************************************************************************
+ * SP-GiST operator class
+ *
+ * email_spgist_ops is a radix tree over a text key made of the reversed
+ * domain, a '.', an '@' and the local part, all in lower case:
+ *
+ *     jas@cse.unsw.edu.au  ->  "au.edu.unsw.cse.@jas"
+ *
+ * Every query the class answers is then a prefix of the key, or the whole
+ * key: "au.edu.unsw.cse.@" for ~, "au.edu.unsw." for <@ 'unsw.edu.au' and
+ * "au.edu.unsw.cse.@j" for ^@ 'j@cse.unsw.edu.au'.  Addresses sharing a
+ * domain share all the inner nodes down to the '@', so the domains are
+ * stored about once per index rather than once per row.
+ *
+ * The keys are shaped exactly like the text radix tree's, so choosing and
+ * splitting are left to spg_text_choose and spg_text_picksplit.  Leaves
+ * hold the key and not the address, which rules out index only scans.
+ * Needs PostgreSQL 11 or later, for the compress method.
+ *****************************************************************************/
+
+/**
+   Writes the SP-GiST key of an address into buf, which must have room for
+   2 * MAX_CHARS + 2 bytes.
+   @RETURN: the number of bytes written.
+*/
+int email_spg_key (EmailParts *parts, char *buf)
+{
+	int			len = reverse_domain(parts->domain, parts->domain_len, buf);
+	int			i;
+
+	buf[len++] = '.';
+	buf[len++] = '@';
+	for (i = 0; i < parts->local_len; i++)
+		buf[len++] = ASCII_TOLOWER((unsigned char) parts->local[i]);
+	return len;
+}
+
+#if PG_VERSION_NUM >= 110000
+
+#define EMAIL_SPG_EQUAL         1    // =
+#define EMAIL_SPG_SAME_DOMAIN   2    // ~
+#define EMAIL_SPG_WITHIN        3    // <@
+#define EMAIL_SPG_STARTS_WITH   4    // ^@
+
+/* A scan key turned into a (prefix of a) key */
+typedef struct EmailSpgQuery
+{
+	bool		exact;               // the whole key must match
+	int			len;
+	char		key[2 * MAX_CHARS + 2];
+}	EmailSpgQuery;
+
+static text *
+email_spg_key_text(Datum datum)
+{
+	EmailParts	parts;
+	text	   *result = (text *) palloc(VARHDRSZ + 2 * MAX_CHARS + 2);
+
+	email_unpack((EmailAddress *) PG_DETOAST_DATUM_PACKED(datum), &parts);
+	SET_VARSIZE(result, VARHDRSZ + email_spg_key(&parts, VARDATA(result)));
+	return result;
+}
+
+static void
+email_spg_query(ScanKey skey, EmailSpgQuery *query)
+{
+	EmailParts	parts;
+	text	   *arg;
+	const char *str;
+	int			len;
+
+	query->exact = false;
+	switch (skey->sk_strategy) {
+		case EMAIL_SPG_EQUAL:
+			email_unpack((EmailAddress *) PG_DETOAST_DATUM_PACKED(skey->sk_argument), &parts);
+			query->len = email_spg_key(&parts, query->key);
+			query->exact = true;
+			break;
+		case EMAIL_SPG_SAME_DOMAIN:
+			email_unpack((EmailAddress *) PG_DETOAST_DATUM_PACKED(skey->sk_argument), &parts);
+			parts.local_len = 0;
+			query->len = email_spg_key(&parts, query->key);
+			break;
+		case EMAIL_SPG_WITHIN:
+			arg = DatumGetTextPP(skey->sk_argument);
+			str = VARDATA_ANY(arg);
+			len = VARSIZE_ANY_EXHDR(arg);
+			if (len > 0 && str[0] == '.') {
+				str++;
+				len--;
+			}
+			// a suffix longer than any domain matches nothing, like "."
+			if (len >= MAX_CHARS)
+				len = 0;
+			query->len = reverse_domain(str, len, query->key);
+			query->key[query->len++] = '.';
+			break;
+		case EMAIL_SPG_STARTS_WITH:
+			email_prefix_parse(DatumGetTextPP(skey->sk_argument), &parts);
+			if (parts.domain_len >= MAX_CHARS)
+				parts.domain_len = 0;
+			if (parts.local_len >= MAX_CHARS)
+				parts.local_len = MAX_CHARS;
+			query->len = email_spg_key(&parts, query->key);
+			break;
+		default:
+			elog(ERROR, "unrecognized strategy number: %d", skey->sk_strategy);
+	}
+}
+
+/**
+   The queries of a scan, one per scan key.  They are built once, at the
+   root, and handed down the tree as the traversal value of every node
+   that matches, so that no inner or leaf tuple builds them again.  Only
+   a scan whose root is a leaf page builds them per tuple.
+   @PARAMS traversal: the traversal value of the tuple, NULL at the root.
+*/
+static EmailSpgQuery *
+email_spg_queries(ScanKey scankeys, int nkeys, void *traversal)
+{
+	EmailSpgQuery *queries;
+	int			j;
+
+	if (traversal != NULL)
+		return (EmailSpgQuery *) traversal;
+	queries = (EmailSpgQuery *) palloc(sizeof(EmailSpgQuery) * Max(nkeys, 1));
+	for (j = 0; j < nkeys; j++)
+		email_spg_query(&scankeys[j], &queries[j]);
+	return queries;
+}
+
+PG_FUNCTION_INFO_V1(email_spg_config);
+
+Datum
+email_spg_config(PG_FUNCTION_ARGS)
+{
+	spgConfigOut *cfg = (spgConfigOut *) PG_GETARG_POINTER(1);
+
+	cfg->prefixType = TEXTOID;
+	cfg->labelType = INT2OID;
+	cfg->leafType = TEXTOID;
+	cfg->canReturnData = false;
+	cfg->longValuesOK = true;
+	PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(email_spg_compress);
+
+Datum
+email_spg_compress(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_TEXT_P(email_spg_key_text(PG_GETARG_DATUM(0)));
+}
+
+/**
+   spg_text_choose works from the original datum at every level, so it
+   is handed the key in place of the address.
+*/
+PG_FUNCTION_INFO_V1(email_spg_choose);
+
+Datum
+email_spg_choose(PG_FUNCTION_ARGS)
+{
+	spgChooseIn *in = (spgChooseIn *) PG_GETARG_POINTER(0);
+	spgChooseIn textin = *in;
+
+	textin.datum = PointerGetDatum(email_spg_key_text(in->datum));
+	return DirectFunctionCall2Coll(spg_text_choose, C_COLLATION_OID,
+	                               PointerGetDatum(&textin),
+	                               PG_GETARG_DATUM(1));
+}
+
+PG_FUNCTION_INFO_V1(email_spg_inner_consistent);
+
+Datum
+email_spg_inner_consistent(PG_FUNCTION_ARGS)
+{
+	spgInnerConsistentIn *in = (spgInnerConsistentIn *) PG_GETARG_POINTER(0);
+	spgInnerConsistentOut *out = (spgInnerConsistentOut *) PG_GETARG_POINTER(1);
+	text	   *reconstr = (text *) DatumGetPointer(in->reconstructedValue);
+	EmailSpgQuery *queries;
+	text	   *value;
+	int			prefix_len = 0;
+	int			max_len, i, j;
+
+	queries = email_spg_queries(in->scankeys, in->nkeys, in->traversalValue);
+
+	// the key so far, plus room for the node label
+	if (in->hasPrefix)
+		prefix_len = VARSIZE_ANY_EXHDR(DatumGetTextPP(in->prefixDatum));
+	max_len = in->level + prefix_len + 1;
+	value = (text *) palloc(VARHDRSZ + max_len);
+	if (in->level)
+		memcpy(VARDATA(value), VARDATA(reconstr), in->level);
+	if (prefix_len)
+		memcpy(VARDATA(value) + in->level,
+		       VARDATA_ANY(DatumGetTextPP(in->prefixDatum)), prefix_len);
+
+	out->nodeNumbers = (int *) palloc(sizeof(int) * in->nNodes);
+	out->levelAdds = (int *) palloc(sizeof(int) * in->nNodes);
+	out->reconstructedValues = (Datum *) palloc(sizeof(Datum) * in->nNodes);
+	if (in->nkeys > 0)
+		out->traversalValues = (void **) palloc(sizeof(void *) * in->nNodes);
+	out->nNodes = 0;
+
+	for (i = 0; i < in->nNodes; i++) {
+		int16		label = DatumGetInt16(in->nodeLabels[i]);
+		int			len = max_len;
+		bool		match = true;
+
+		// labels below 1 do not stand for a byte of the key
+		if (label > 0)
+			((unsigned char *) VARDATA(value))[max_len - 1] = (unsigned char) label;
+		else
+			len--;
+
+		// the key so far must agree with every query as far as both go
+		for (j = 0; j < in->nkeys && match; j++)
+			match = memcmp(VARDATA(value), queries[j].key,
+			               Min(len, queries[j].len)) == 0;
+
+		if (match) {
+			SET_VARSIZE(value, VARHDRSZ + len);
+			out->nodeNumbers[out->nNodes] = i;
+			out->levelAdds[out->nNodes] = len - in->level;
+			out->reconstructedValues[out->nNodes] =
+				datumCopy(PointerGetDatum(value), false, -1);
+			// each node gets its own copy, as the scan frees them one by one
+			if (in->nkeys > 0)
+				out->traversalValues[out->nNodes] =
+					memcpy(MemoryContextAlloc(in->traversalMemoryContext,
+					                          sizeof(EmailSpgQuery) * in->nkeys),
+					       queries, sizeof(EmailSpgQuery) * in->nkeys);
+			out->nNodes++;
+		}
+	}
+	PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(email_spg_leaf_consistent);
+
+Datum
+email_spg_leaf_consistent(PG_FUNCTION_ARGS)
+{
+	spgLeafConsistentIn *in = (spgLeafConsistentIn *) PG_GETARG_POINTER(0);
+	spgLeafConsistentOut *out = (spgLeafConsistentOut *) PG_GETARG_POINTER(1);
+	text	   *reconstr = (text *) DatumGetPointer(in->reconstructedValue);
+	text	   *leaf = DatumGetTextPP(in->leafDatum);
+	int			leaf_len = VARSIZE_ANY_EXHDR(leaf);
+	int			len = in->level + leaf_len;
+	char		key[2 * MAX_CHARS + 2];
+	EmailSpgQuery *queries;
+	int			j;
+
+	// the key is exact for valid addresses, no recheck needed
+	out->recheck = false;
+	if (len > (int) sizeof(key))
+		PG_RETURN_BOOL(false);
+	if (in->level)
+		memcpy(key, VARDATA(reconstr), in->level);
+	memcpy(key + in->level, VARDATA_ANY(leaf), leaf_len);
+
+	queries = email_spg_queries(in->scankeys, in->nkeys, in->traversalValue);
+	for (j = 0; j < in->nkeys; j++) {
+		EmailSpgQuery *query = &queries[j];
+
+		if (query->exact ? len != query->len : len < query->len)
+			PG_RETURN_BOOL(false);
+		if (memcmp(key, query->key, query->len) != 0)
+			PG_RETURN_BOOL(false);
+	}
+	PG_RETURN_BOOL(true);
+}
+
+#endif							/* PG_VERSION_NUM >= 110000 */
+
+/*****************************************************************************
+ * Trigram matching and GIN operator class
+ *
+ * The trigrams of an address are taken straight from its case folded
+ * "local@domain" form (see email_fold_key), padded with two blanks in
+ * front and one behind the way pg_trgm pads a word.  A trigram is packed
+ * into an int4, so the GIN keys need no storage of their own.
+ *
+ *     x @~ 'shepherd'   the address contains "shepherd", ignoring case
+ *     x % 'jon@unsw'    the addresses are at least email.similarity_threshold
+ *                       similar, as told by email_similarity
+ *
+ * A substring only has the trigrams that lie wholly inside it, without
+ * padding; one shorter than three characters matches every address, so
+ * the index has to hand back all of them for the recheck.
+ *****************************************************************************/
+
+#define EMAIL_TRGM_SIMILAR    1    // %
+#define EMAIL_TRGM_CONTAINS   2    // @~
+
+#define TRGM_PACK(s) \
+	((int32) (((unsigned char) (s)[0] << 16) | \
+	          ((unsigned char) (s)[1] << 8) | (unsigned char) (s)[2]))
+
+static int
+trigram_cmp(const void *a, const void *b)
+{
+	int32		x = *(const int32 *) a;
+	int32		y = *(const int32 *) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+   Gives a text in lower case.
+   @PARAMS txt: the text to fold.
+           len: set to the length of the result.
+   @RETURN: the palloc'd folded bytes, not null terminated.
+*/
+char *fold_text (text *txt, int *len)
+{
+	const char *str = VARDATA_ANY(txt);
+	char	   *result;
+	int			i;
+
+	*len = VARSIZE_ANY_EXHDR(txt);
+	result = palloc(*len + 1);
+	for (i = 0; i < *len; i++)
+		result[i] = ASCII_TOLOWER((unsigned char) str[i]);
+	return result;
+}
+
+/**
+   Finds the distinct trigrams of an already folded string.
+   @PARAMS str, len: the string.
+           pad: add the word padding, as for a whole address.
+           trgm: receives the trigrams in ascending order, must have room
+                 for len + 1 of them.
+   @RETURN: the number of distinct trigrams.
+*/
+int email_trigrams (const char *str, int len, bool pad, int32 *trgm)
+{
+	char	   *buf;
+	int			n = 0, i, count;
+
+	if (pad) {
+		buf = palloc(len + 3);
+		buf[0] = buf[1] = ' ';
+		memcpy(buf + 2, str, len);
+		buf[len + 2] = ' ';
+		str = buf;
+		len += 3;
+	}
+	for (i = 0; i + 3 <= len; i++)
+		trgm[n++] = TRGM_PACK(str + i);
+	if (pad)
+		pfree(buf);
+	if (n < 2)
+		return n;
+
+	qsort(trgm, n, sizeof(int32), trigram_cmp);
+	for (i = 1, count = 1; i < n; i++) {
+		if (trgm[i] != trgm[count - 1])
+			trgm[count++] = trgm[i];
+	}
+	return count;
+}
+
+/**
+   The share of trigrams two sets have in common, between 0 and 1.
+   Both sets must be sorted and distinct.
+*/
+float4 trigram_similarity (const int32 *a, int a_len, const int32 *b, int b_len)
+{
+	int			i = 0, j = 0, common = 0;
+
+	if (a_len == 0 || b_len == 0)
+		return 0.0;
+	while (i < a_len && j < b_len) {
+		if (a[i] < b[j])
+			i++;
+		else if (a[i] > b[j])
+			j++;
+		else {
+			common++;
+			i++;
+			j++;
+		}
+	}
+	return (float4) common / (float4) (a_len + b_len - common);
+}
+
+/**
+   The trigram similarity of an address and a text, ignoring case.
+*/
+float4 email_similarity_internal (EmailAddress *email, text *query)
+{
+	char		key[2 * MAX_CHARS];
+	int32		email_trgm[2 * MAX_CHARS + 1];
+	int			key_len = email_fold_key(email, key);
+	int			n_email = email_trigrams(key, key_len, true, email_trgm);
+	int			query_len, n_query;
+	char	   *folded = fold_text(query, &query_len);
+	int32	   *query_trgm = palloc(sizeof(int32) * (query_len + 1));
+	float4		result;
+
+	n_query = email_trigrams(folded, query_len, true, query_trgm);
+	result = trigram_similarity(email_trgm, n_email, query_trgm, n_query);
+	pfree(folded);
+	pfree(query_trgm);
+	return result;
+}
+
+PG_FUNCTION_INFO_V1(email_similarity);
+
+Datum
+email_similarity(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	text	   *query = PG_GETARG_TEXT_PP(1);
+
+	PG_RETURN_FLOAT4(email_similarity_internal(email, query));
+}
+
+/* The similarity function % */
+
+PG_FUNCTION_INFO_V1(email_similar);
+
+Datum
+email_similar(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	text	   *query = PG_GETARG_TEXT_PP(1);
+
+	PG_RETURN_BOOL(email_similarity_internal(email, query) >=
+	               (float4) email_similarity_threshold);
+}
+
+/* The contains function @~ */
+
+PG_FUNCTION_INFO_V1(email_contains);
+
+Datum
+email_contains(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	text	   *query = PG_GETARG_TEXT_PP(1);
+	char		key[2 * MAX_CHARS];
+	int			key_len = email_fold_key(email, key);
+	int			query_len, i;
+	char	   *folded = fold_text(query, &query_len);
+
+	for (i = 0; i + query_len <= key_len; i++) {
+		if (memcmp(key + i, folded, query_len) == 0)
+			PG_RETURN_BOOL(true);
+	}
+	PG_RETURN_BOOL(false);
+}
+
+PG_FUNCTION_INFO_V1(email_gin_extract_value);
+
+Datum
+email_gin_extract_value(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	int32	   *nentries = (int32 *) PG_GETARG_POINTER(1);
+	char		key[2 * MAX_CHARS];
+	int32		trgm[2 * MAX_CHARS + 1];
+	int			key_len = email_fold_key(email, key);
+	Datum	   *entries;
+	int			i;
+
+	*nentries = email_trigrams(key, key_len, true, trgm);
+	entries = (Datum *) palloc(sizeof(Datum) * *nentries);
+	for (i = 0; i < *nentries; i++)
+		entries[i] = Int32GetDatum(trgm[i]);
+	PG_RETURN_POINTER(entries);
+}
+
+PG_FUNCTION_INFO_V1(email_gin_extract_query);
+
+Datum
+email_gin_extract_query(PG_FUNCTION_ARGS)
+{
+	text	   *query = PG_GETARG_TEXT_PP(0);
+	int32	   *nentries = (int32 *) PG_GETARG_POINTER(1);
+	StrategyNumber strategy = PG_GETARG_UINT16(2);
+	int32	   *searchMode = (int32 *) PG_GETARG_POINTER(6);
+	int			query_len, i;
+	char	   *folded = fold_text(query, &query_len);
+	int32	   *trgm = palloc(sizeof(int32) * (query_len + 1));
+	Datum	   *entries;
+
+	switch (strategy) {
+		case EMAIL_TRGM_SIMILAR:
+			*nentries = email_trigrams(folded, query_len, true, trgm);
+			break;
+		case EMAIL_TRGM_CONTAINS:
+			*nentries = email_trigrams(folded, query_len, false, trgm);
+			if (*nentries == 0)
+				*searchMode = GIN_SEARCH_MODE_ALL;
+			break;
+		default:
+			elog(ERROR, "unrecognized strategy number: %d", strategy);
+	}
+	entries = (Datum *) palloc(sizeof(Datum) * Max(*nentries, 1));
+	for (i = 0; i < *nentries; i++)
+		entries[i] = Int32GetDatum(trgm[i]);
+	pfree(folded);
+	pfree(trgm);
+	PG_RETURN_POINTER(entries);
+}
+
+PG_FUNCTION_INFO_V1(email_gin_consistent);
+
+Datum
+email_gin_consistent(PG_FUNCTION_ARGS)
+{
+	bool	   *check = (bool *) PG_GETARG_POINTER(0);
+	StrategyNumber strategy = PG_GETARG_UINT16(1);
+	int32		nkeys = PG_GETARG_INT32(3);
+	bool	   *recheck = (bool *) PG_GETARG_POINTER(5);
+	int			present = 0, i;
+
+	// the trigrams only ever narrow things down
+	*recheck = true;
+	for (i = 0; i < nkeys; i++) {
+		if (check[i])
+			present++;
+	}
+	switch (strategy) {
+		case EMAIL_TRGM_SIMILAR:
+			// the best an address with these trigrams can score
+			PG_RETURN_BOOL(nkeys > 0 &&
+			               (float4) present / (float4) nkeys >=
+			               (float4) email_similarity_threshold);
+		case EMAIL_TRGM_CONTAINS:
+			PG_RETURN_BOOL(present == nkeys);
+		default:
+			elog(ERROR, "unrecognized strategy number: %d", strategy);
+	}
+	PG_RETURN_BOOL(false);
+}
+
+/*****************************************************************************
+ * Operator class for defining hash index
+ *
+ * The hash functions have to agree with email_cmp_internal: two addresses
+ * that compare equal must hash the same, so the key that gets hashed is
+ * case folded with the same ASCII_TOLOWER that parts_casecmp uses.
+ *****************************************************************************/
+
+/**
+   Writes the case folded "local@domain" form of an address into buf,
+   which must have room for 2 * MAX_CHARS bytes.
+   @RETURN: the number of bytes written.
+*/
+int email_fold_key (EmailAddress *email, char *buf)
+{
+	EmailParts parts;
+
+	email_unpack(email, &parts);
+	return email_fold_parts(&parts, buf);
+}
+
+/**
+   Same as email_fold_key, for an address already unpacked.
+*/
+int email_fold_parts (EmailParts *parts, char *buf)
+{
+	int i, n = 0;
+
+	for (i = 0; i < parts->local_len; i++)
+		buf[n++] = ASCII_TOLOWER((unsigned char) parts->local[i]);
+	buf[n++] = '@';
+	for (i = 0; i < parts->domain_len; i++)
+		buf[n++] = ASCII_TOLOWER((unsigned char) parts->domain[i]);
+	return n;
+}
+
+PG_FUNCTION_INFO_V1(email_hash);
+
+Datum
+email_hash(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	char		key[2 * MAX_CHARS];
+	int			len = email_fold_key(email, key);
+
+	PG_RETURN_DATUM(hash_any((unsigned char *) key, len));
+}
+
+#if PG_VERSION_NUM >= 110000
+
+PG_FUNCTION_INFO_V1(email_hash_extended);
+
+Datum
+email_hash_extended(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	uint64		seed = (uint64) PG_GETARG_INT64(1);
+	char		key[2 * MAX_CHARS];
+	int			len = email_fold_key(email, key);
+
+	PG_RETURN_DATUM(hash_any_extended((unsigned char *) key, len, seed));
+}
+
+#endif
+
+
+/*****************************************************************************
+ * Canonical addresses
+ *
+ * Many spellings can reach the same mailbox: gmail.com ignores the dots
+ * of the local part, most big providers ignore a "+tag", and
+ * googlemail.com is gmail.com.  The rules are per domain and built in
+ * (email_canon_rules in email_core.c), so that email_canonical and the
+ * email_canonical_ops opclasses are immutable.  The input functions take
+ * a +tag at the domains that drop one (parseEmailInput).  They store an
+ * address as given, unless the column is EmailAddress(canonical): then
+ * email_in and email_recv store the canonical form, and so does the
+ * length coercion cast for a value from anywhere else, so the rules are
+ * applied once per row, at ingest.
+ *****************************************************************************/
+
+/**
+   Unpacks an address as its canonical form would be: local part in its
+   original case and without the characters its domain ignores, domain
+   replaced by the one it is an alias of.
+   @PARAMS buf: room for MAX_CHARS bytes, may hold the local part.
+           parts: gets local and domain; casemap, flags and domain_id are
+             cleared, as they describe the stored value.
+*/
+void email_canonical_parts (EmailAddress *email, char *buf, EmailParts *parts) {
+	int policy;
+
+	email_unpack(email, parts);
+	parts->local = email_restore_case(parts, buf);
+	policy = email_canon_policy(parts->domain, parts->domain_len,
+	                            &parts->domain, &parts->domain_len);
+	if (policy) {
+		parts->local_len = email_canonical_local(parts->local, parts->local_len, policy, buf);
+		parts->local = buf;
+	}
+	parts->casemap = NULL;
+	parts->flags = 0;
+	parts->domain_id = 0;
+}
+
+/**
+   Compares the canonical forms of two addresses, domain first then local,
+   ignoring case like email_cmp_internal.
+*/
+int email_canon_cmp_internal (EmailAddress *a, EmailAddress *b) {
+	EmailParts pa, pb;
+	char buf_a[MAX_CHARS], buf_b[MAX_CHARS];
+	int result;
+
+	email_canonical_parts(a, buf_a, &pa);
+	email_canonical_parts(b, buf_b, &pb);
+	result = parts_casecmp(pa.domain, pa.domain_len, pb.domain, pb.domain_len);
+	if (result == 0)
+		result = parts_casecmp(pa.local, pa.local_len, pb.local, pb.local_len);
+	return result;
+}
+
+PG_FUNCTION_INFO_V1(email_canonical);
+
+Datum
+email_canonical(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	EmailParts	parts;
+	char		local[MAX_CHARS];
+
+	email_canonical_parts(email, local, &parts);
+	PG_RETURN_POINTER(email_pack(parts.local, parts.local_len,
+	                             parts.domain, parts.domain_len,
+	                             email_store_flags()));
+}
+
+/**
+   Packs an address the input functions parsed, in canonical form if the
+   column it is for is EmailAddress(canonical).
+   @PARAMS str, parse: a text parseEmailInput accepted, and its parse.
+           typmod: that of the column, -1 if unknown.
+           store: store bits, see email_pack_into.
+*/
+EmailAddress *email_pack_input (const char *str, EmailParse *parse, int32 typmod, int store) {
+	const char *local = str;
+	const char *domain = str + parse->local_len + 1;
+	int			local_len = parse->local_len;
+	int			domain_len = parse->domain_len;
+	char		buf[MAX_CHARS];
+	int			policy;
+
+	if (typmod == EMAIL_TYPMOD_CANONICAL) {
+		policy = email_canon_policy(domain, domain_len, &domain, &domain_len);
+		if (policy) {
+			local_len = email_canonical_local(local, local_len, policy, buf);
+			local = buf;
+		}
+	}
+	return email_pack(local, local_len, domain, domain_len, store);
+}
+
+/**
+   Reads the type modifier of EmailAddress, of which there is one:
+   EmailAddress(canonical).
+*/
+PG_FUNCTION_INFO_V1(email_typmod_in);
+
+Datum
+email_typmod_in(PG_FUNCTION_ARGS)
+{
+	ArrayType  *mods = PG_GETARG_ARRAYTYPE_P(0);
+	Datum	   *elems;
+	int			n;
+
+	deconstruct_array(mods, CSTRINGOID, -2, false, 'c', &elems, NULL, &n);
+	if (n != 1 || pg_strcasecmp(DatumGetCString(elems[0]), "canonical") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid type modifier for EmailAddress"),
+				 errhint("The only modifier is \"canonical\".")));
+	PG_RETURN_INT32(EMAIL_TYPMOD_CANONICAL);
+}
+
+PG_FUNCTION_INFO_V1(email_typmod_out);
+
+Datum
+email_typmod_out(PG_FUNCTION_ARGS)
+{
+	int32		typmod = PG_GETARG_INT32(0);
+
+	PG_RETURN_CSTRING(pstrdup(typmod == EMAIL_TYPMOD_CANONICAL ? "(canonical)" : ""));
+}
+
+/**
+   The length coercion cast of EmailAddress, which postgres applies to
+   every value stored in a column with a type modifier.  Only values into
+   an EmailAddress(canonical) column change, to their canonical form.
+*/
+PG_FUNCTION_INFO_V1(email_coerce);
+
+Datum
+email_coerce(PG_FUNCTION_ARGS)
+{
+	int32		typmod = PG_GETARG_INT32(1);
+
+	if (typmod != EMAIL_TYPMOD_CANONICAL)
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	PG_RETURN_DATUM(DirectFunctionCall1(email_canonical, PG_GETARG_DATUM(0)));
+}
+
+PG_FUNCTION_INFO_V1(email_canon_lt);
+
+Datum
+email_canon_lt(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_BOOL(email_canon_cmp_internal(a, b) < 0);
+}
+
+PG_FUNCTION_INFO_V1(email_canon_le);
+
+Datum
+email_canon_le(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_BOOL(email_canon_cmp_internal(a, b) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(email_canon_eq);
+
+Datum
+email_canon_eq(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_BOOL(email_canon_cmp_internal(a, b) == 0);
+}
+
+PG_FUNCTION_INFO_V1(email_canon_ge);
+
+Datum
+email_canon_ge(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_BOOL(email_canon_cmp_internal(a, b) >= 0);
+}
+
+PG_FUNCTION_INFO_V1(email_canon_gt);
+
+Datum
+email_canon_gt(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_BOOL(email_canon_cmp_internal(a, b) > 0);
+}
+
+PG_FUNCTION_INFO_V1(email_canon_cmp);
+
+Datum
+email_canon_cmp(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *a = PG_GETARG_EMAIL_P(0);
+	EmailAddress    *b = PG_GETARG_EMAIL_P(1);
+
+	PG_RETURN_INT32(email_canon_cmp_internal(a, b));
+}
+
+PG_FUNCTION_INFO_V1(email_canon_hash);
+
+Datum
+email_canon_hash(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	EmailParts	parts;
+	char		local[MAX_CHARS];
+	char		key[2 * MAX_CHARS];
+
+	email_canonical_parts(email, local, &parts);
+	PG_RETURN_DATUM(hash_any((unsigned char *) key, email_fold_parts(&parts, key)));
+}
+
+#if PG_VERSION_NUM >= 110000
+
+PG_FUNCTION_INFO_V1(email_canon_hash_extended);
+
+Datum
+email_canon_hash_extended(PG_FUNCTION_ARGS)
+{
+	EmailAddress    *email = PG_GETARG_EMAIL_P(0);
+	uint64		seed = (uint64) PG_GETARG_INT64(1);
+	EmailParts	parts;
+	char		local[MAX_CHARS];
+	char		key[2 * MAX_CHARS];
+
+	email_canonical_parts(email, local, &parts);
+	PG_RETURN_DATUM(hash_any_extended((unsigned char *) key,
+	                                  email_fold_parts(&parts, key), seed));
+}
+
+#endif
+
+
+/*****************************************************************************
+ * Usage counters
+ *
+ * With email.track_stats on, parses, parse failures by reason, calls of
+ * email_cmp_internal and the bytes allocated for values and their text
+ * are counted, per backend, and for the whole cluster when the module is
+ * in shared_preload_libraries.  email_stats reports both.  Every function
+ * that parses text counts, email_is_valid and email_validate included.
+ *
+ * A parallel worker is a backend of its own: what it counts reaches the
+ * cluster's counters when its transaction ends, but never the backend row
+ * of the leader whose query it ran.  Nothing carries counts back from the
+ * workers, so the backend row undercounts parallel queries.
+ *****************************************************************************/
+
+/**
+   Adds this backend's counts since the last flush to the cluster's.
+*/
+void email_stats_flush (void) {
+	int i;
+
+	email_stats_dirty = false;
+	if (email_shared_stats == NULL)
+		return;
+	for (i = 0; i < EMAIL_NUM_STATS; i++) {
+		uint64 delta = email_stats_local[i] - email_stats_flushed[i];
+
+		if (delta != 0)
+			pg_atomic_fetch_add_u64(&email_shared_stats->counters[i], (int64) delta);
+		email_stats_flushed[i] = email_stats_local[i];
+	}
+}
+
+/**
+   One row for this backend, and one for the cluster if the module was
+   preloaded.  The backend row leaves out what parallel workers counted
+   for this session's queries; only the cluster row has that.
+*/
+PG_FUNCTION_INFO_V1(email_stats);
+
+Datum
+email_stats(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+
+	if (SRF_IS_FIRSTCALL()) {
+		MemoryContext oldcontext;
+		TupleDesc	tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+		funcctx->max_calls = email_shared_stats ? 2 : 1;
+		MemoryContextSwitchTo(oldcontext);
+
+		email_stats_flush();
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	if (funcctx->call_cntr < funcctx->max_calls) {
+		Datum		values[EMAIL_NUM_STATS + 1];
+		bool		nulls[EMAIL_NUM_STATS + 1];
+		bool		backend = (funcctx->call_cntr == 0);
+		int			i;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(backend ? "backend" : "cluster");
+		for (i = 0; i < EMAIL_NUM_STATS; i++) {
+			uint64 n = backend ? email_stats_local[i] :
+				pg_atomic_read_u64(&email_shared_stats->counters[i]);
+
+			values[i + 1] = Int64GetDatum((int64) n);
+		}
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc,
+		                                                           values, nulls)));
+	}
+	SRF_RETURN_DONE(funcctx);
+}
@@ -26,7 +26,19 @@
 -- Look at $PWD/complex.c for the source.  Note that we declare all of
 -- them as STRICT, so we do not need to cope with NULL inputs in the
 -- C code.  We also mark them IMMUTABLE, since they always return the
--- same outputs given the same inputs.
+-- same outputs given the same inputs.  The email.* settings that most of
+-- them read only change how compactly a value is stored, whether it is
+-- cached, and what is counted or logged, never what a value prints as or
+-- compares to.  The exceptions are marked as such: email_similar (the %
+-- operator) is STABLE, as email.similarity_threshold decides its result,
+-- so are the selectivity estimators, which read the statistics, and the
+-- functions that report the cache and the counters are VOLATILE.  All but
+-- those reports are PARALLEL SAFE: what they keep between calls is local
+-- to the backend, and the settings are passed on to parallel workers.
+-- The comparison functions and the part accessors are LEAKPROOF too
+-- (which needs a superuser): they can only fail on a corrupt value, with
+-- a message that says nothing of its contents, so the planner may push
+-- them below security barrier views and row level security quals.
 
 -- the input function 'complex_in' takes a null-terminated string (the
 -- textual representation of the type) and turns it into the internal
@@ -36,7 +48,7 @@
 CREATE FUNCTION email_in(cstring)
    RETURNS EmailAddress
    AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
-   LANGUAGE C IMMUTABLE STRICT;
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 -- the output function 'complex_out' takes the internal representation and
 -- converts it into the textual representation.
@@ -44,7 +56,7 @@ CREATE FUNCTION email_in(cstring)
 CREATE FUNCTION email_out(EmailAddress)
    RETURNS cstring
    AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
-   LANGUAGE C IMMUTABLE STRICT;
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 -- the binary input function 'complex_recv' takes a StringInfo buffer
 -- and turns its contents into the internal representation.
@@ -52,27 +64,92 @@ CREATE FUNCTION email_out(EmailAddress)
 CREATE FUNCTION email_recv(internal)
    RETURNS EmailAddress
    AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
-   LANGUAGE C IMMUTABLE STRICT;
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 -- the binary output function 'complex_send' takes the internal representation
 -- and converts it into a (hopefully) platform-independent bytea string.
+-- For EmailAddress that is a version byte, a flags byte, then each part
+-- prefixed with its length (see email.c); email_recv validates it all.
+-- The domain always goes out by name, whatever email.encode_domains says.
 
 CREATE FUNCTION email_send(EmailAddress)
    RETURNS bytea
    AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
-   LANGUAGE C IMMUTABLE STRICT;
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
+-- the analyze function 'email_typanalyze' gathers the usual statistics and
+-- adds its own on the domains: the most common ones, how many there are,
+-- a histogram of the rest and the average length of the local parts.
 
--- now, we can create the type. The internallength specifies the size of the
--- memory block required to hold the type (we need two 8-byte doubles).
+CREATE FUNCTION email_typanalyze(internal)
+   RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
+   LANGUAGE C STRICT PARALLEL SAFE;
+
+-- the type modifier functions read and print the one modifier there is,
+-- EmailAddress(canonical), for columns that store addresses in their
+-- canonical form (see "Canonical addresses" below).
+
+CREATE FUNCTION email_typmod_in(cstring[])
+   RETURNS integer
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION email_typmod_out(integer)
+   RETURNS cstring
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+
+-- now, we can create the type. EmailAddress is variable length: a two byte
+-- header, then the local and domain bytes with no padding.  Any storage
+-- other than plain lets postgres use a 1-byte varlena header on disk, so
+-- a short address costs only a few bytes more than its text.
 
 CREATE TYPE EmailAddress (
+   internallength = VARIABLE,
    input = email_in,
    output = email_out,
    receive = email_recv,
-   send = email_send
+   send = email_send,
+   typmod_in = email_typmod_in,
+   typmod_out = email_typmod_out,
+   analyze = email_typanalyze,
+   storage = main
 );
 
+-- email_upgrade rewrites a value in the packed layout.  Values stored by
+-- older versions of this module (fixed 256 byte payload) are still read
+-- correctly, this is only needed to reclaim their space.
+
+CREATE FUNCTION email_upgrade(EmailAddress)
+   RETURNS EmailAddress
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- a cast to text that builds the text directly, rather than going through
+-- email_out and a cstring
+
+CREATE FUNCTION email_text(EmailAddress)
+   RETURNS text
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (EmailAddress AS text) WITH FUNCTION email_text(EmailAddress);
+
+-- the two parts on their own, read straight from the stored value; handy
+-- for GROUP BY and expression indexes on the domain.
+
+CREATE FUNCTION email_domain(EmailAddress)
+   RETURNS text
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+
+CREATE FUNCTION email_local(EmailAddress)
+   RETURNS text
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+
 
 -----------------------------
 -- Using the new type:
@@ -101,6 +178,105 @@ INSERT INTO test_email VALUES ('joe@cse.unsw.edu.au', 'bob@hotmail.com');
 INSERT INTO test_email VALUES ('joe@cse.UNSW.edu.au', 'bob@hotmail.COM');
 
 SELECT * FROM test_email;
+SELECT x::text, length(y::text) FROM test_email;
+SELECT email_domain(x), count(*) FROM test_email GROUP BY 1;
+SELECT email_local(y), email_domain(y) FROM test_email;
+
+-- try_email_in and email_parse_array parse text without raising errors:
+-- an invalid address gives NULL.  email_parse_array does a whole batch in
+-- one call, which is the cheap way to bulk load from a staging table.
+
+CREATE FUNCTION try_email_in(text)
+   RETURNS EmailAddress
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION email_parse_array(text[])
+   RETURNS EmailAddress[]
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- email_is_valid and email_validate only check a text: the latter says
+-- why an address was rejected and at which character.  From PostgreSQL 16
+-- on email_in reports soft errors, so pg_input_is_valid works as well.
+
+CREATE FUNCTION email_is_valid(text)
+   RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION email_validate(text,
+   OUT valid bool, OUT error text, OUT position int4)
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email'
+   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+SELECT try_email_in('jas@cse.unsw.edu.au'), try_email_in('not an address');
+SELECT email_is_valid('jas@cse.unsw.edu.au'), email_is_valid('jas@');
+SELECT * FROM email_validate('jas@cse..unsw.edu.au');
+--SELECT pg_input_is_valid('jas@', 'EmailAddress');
+SELECT email_parse_array(ARRAY['a@b.com', 'bad', NULL, 'John@Example.org']);
+--INSERT INTO test_email (x)
+--   SELECT unnest(email_parse_array(array_agg(raw))) FROM staging;
+
+-- email_in can report why a value is rejected.  The trace is written at
+-- DEBUG2 and costs nothing while email.trace_parse is off.
+
+--SET email.trace_parse = on;
+--SET client_min_messages = debug2;
+--SELECT 'john@localhost'::EmailAddress;
+
+-- Comparisons ignore case.  With email.fold_case set to 'domain' or 'all',
+-- new values are stored lower cased so that comparing two of them is a
+-- plain memcmp.  A folded local part keeps a bitmap of its upper case
+-- letters, and a domain is only folded if it is lower case already, so a
+-- value prints as it was typed either way.  email_upgrade(x) refolds old
+-- rows.
+
+--SET email.fold_case = 'all';
+
+-- Addresses at the big mail providers (gmail.com, yahoo.com, ...) can
+-- store their domain, when it is written in lower case, as a one byte id
+-- from a built-in dictionary, which
+-- saves most of the domain bytes and lets two such domains compare as
+-- integers.  Only versions of this module that have the dictionary can
+-- read these values, so it is off by default.
+
+--SET email.encode_domains = on;
+--SELECT pg_column_size('john@gmail.com'::EmailAddress);
+
+-- A backend that parses the same strings again and again (bound
+-- parameters, say) can keep the values of the most recent ones and skip
+-- the parsing; email.parse_cache_size sets how many, and
+-- email_parse_cache_stats tells how well it works.
+
+CREATE FUNCTION email_parse_cache_stats(OUT size int4, OUT entries int4,
+                                        OUT hits int8, OUT misses int8)
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+--SET email.parse_cache_size = 4096;
+--SELECT 'jas@cse.unsw.edu.au'::EmailAddress FROM generate_series(1, 3);
+--SELECT * FROM email_parse_cache_stats();
+
+-- With email.track_stats on (it takes a superuser to set), email_stats
+-- counts parsed addresses, the failures by reason, comparisons and the
+-- bytes allocated for values and their text.  The 'backend' row is this
+-- session's; a 'cluster' row, the sum over all sessions so far, needs
+-- the module in shared_preload_libraries.  Parallel workers count into
+-- the 'cluster' row only, so the 'backend' row of a session that ran
+-- parallel queries comes out low.  A switched off counter costs next to
+-- nothing, so it can stay on in production.
+
+CREATE FUNCTION email_stats(OUT scope text, OUT parses int8,
+                            OUT no_local int8, OUT no_domain int8,
+                            OUT invalid_character int8, OUT invalid_local int8,
+                            OUT invalid_domain int8, OUT too_long int8,
+                            OUT compares int8, OUT bytes int8)
+   RETURNS SETOF record
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+--SET email.track_stats = on;
+--SELECT count(*) FROM test_email WHERE x < 'jas@cse.unsw.edu.au';
+--SELECT * FROM email_stats();
 
 -----------------------------
 -- Creating an operator for the new type:
@@ -121,21 +297,35 @@ SELECT * FROM test_email;
 
 -- first, define the required operators
 CREATE FUNCTION email_lt(EmailAddress, EmailAddress) RETURNS bool
-   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT;
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
 CREATE FUNCTION email_le(EmailAddress, EmailAddress) RETURNS bool
-   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT;
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
 CREATE FUNCTION email_eq(EmailAddress, EmailAddress) RETURNS bool
-   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT;
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
 CREATE FUNCTION email_ne(EmailAddress, EmailAddress) RETURNS bool
-   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT;
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
 CREATE FUNCTION email_ge(EmailAddress, EmailAddress) RETURNS bool
-   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT;
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
 CREATE FUNCTION email_gt(EmailAddress, EmailAddress) RETURNS bool
-   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT;
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+-- the planner support function lets a btree index on email_ops answer ~
+-- with a range scan over the domain (needs PostgreSQL 12 or later)
+CREATE FUNCTION email_de_support(internal) RETURNS internal
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 CREATE FUNCTION email_de(EmailAddress, EmailAddress) RETURNS bool
-   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT;
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF
+   SUPPORT email_de_support;
 CREATE FUNCTION email_dne(EmailAddress, EmailAddress) RETURNS bool
-   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT;
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+-- ~ matches a whole domain, not one address, so it has its own estimators
+CREATE FUNCTION email_de_sel(internal, oid, internal, int4) RETURNS float8
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C STABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_dne_sel(internal, oid, internal, int4) RETURNS float8
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C STABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_de_joinsel(internal, oid, internal, int2, internal) RETURNS float8
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C STABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_dne_joinsel(internal, oid, internal, int2, internal) RETURNS float8
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C STABLE STRICT PARALLEL SAFE;
 
 CREATE OPERATOR < (
    leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_lt,
@@ -150,9 +340,8 @@ CREATE OPERATOR <= (
 CREATE OPERATOR = (
    leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_eq,
    commutator = = , negator = <>,
-   -- leave out negator since we didn't create <> operator
-   -- negator = <> ,
-   restrict = eqsel, join = eqjoinsel
+   restrict = eqsel, join = eqjoinsel,
+   hashes, merges
 );
 CREATE OPERATOR >= (
    leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_ge,
@@ -174,19 +363,24 @@ CREATE OPERATOR <> (
 CREATE OPERATOR ~ (
    leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_de,
    commutator = ~ , negator = !~,
-   restrict = eqsel, join = eqjoinsel
+   restrict = email_de_sel, join = email_de_joinsel
 );
 
 CREATE OPERATOR !~ (
    leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_dne,
    commutator = !~ , negator = ~,
-   restrict = neqsel, join = neqjoinsel
+   restrict = email_dne_sel, join = email_dne_joinsel
 );
 
 
 -- create the support function too
 CREATE FUNCTION email_cmp(EmailAddress, EmailAddress) RETURNS int4
-   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT;
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+
+-- and a sort support function, which lets sorts and index builds compare
+-- without fmgr overhead and mostly on abbreviated integer keys
+CREATE FUNCTION email_sortsupport(internal) RETURNS void
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 -- now we can make the operator class
 CREATE OPERATOR CLASS email_ops
@@ -196,7 +390,23 @@ CREATE OPERATOR CLASS email_ops
         OPERATOR        3       = ,
         OPERATOR        4       >= ,
         OPERATOR        5       > ,
-        FUNCTION        1       email_cmp(EmailAddress, EmailAddress);
+        FUNCTION        1       email_cmp(EmailAddress, EmailAddress),
+        FUNCTION        2       email_sortsupport(internal);
+
+
+-- a hash operator class as well, so that hash joins, hash aggregation,
+-- DISTINCT and hash partitioning work on EmailAddress.  The hash functions
+-- fold case just like the comparisons do.
+CREATE FUNCTION email_hash(EmailAddress) RETURNS int4
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_hash_extended(EmailAddress, int8) RETURNS int8
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR CLASS email_hash_ops
+    DEFAULT FOR TYPE EmailAddress USING hash AS
+        OPERATOR        1       = ,
+        FUNCTION        1       email_hash(EmailAddress),
+        FUNCTION        2       email_hash_extended(EmailAddress, int8);
 
 
 -- now, we can define a btree index on complex types. First, let's populate
@@ -216,6 +426,419 @@ SELECT * from test_email where x <> 'jas@cse.unsw.edu.au';
 SELECT * from test_email where x ~ 'jas@cse.unsw.edu.au';
 SELECT * from test_email where x !~ 'jas@cse.unsw.edu.au';
 
+-- all the addresses at one domain are a single range of the index
+EXPLAIN (COSTS OFF) SELECT * from test_email where x ~ 'jas@cse.unsw.edu.au';
+
+-- equal addresses hash together, whatever their case
+SELECT x, count(*) FROM test_email GROUP BY x;
+
+-----------------------------
+-- Ordering by reversed domain:
+--	email_rdomain_ops is a second btree operator class.  It orders by the
+--	domain labels read right to left, so that a domain and all of its
+--	subdomains are next to each other in the index, and "x <@ 'unsw.edu.au'"
+--	(x is at unsw.edu.au or any subdomain of it) becomes one range scan.
+-----------------------------
+
+CREATE FUNCTION email_reverse_domain(EmailAddress) RETURNS text
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION email_rdomain_lt(EmailAddress, EmailAddress) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION email_rdomain_le(EmailAddress, EmailAddress) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION email_rdomain_ge(EmailAddress, EmailAddress) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION email_rdomain_gt(EmailAddress, EmailAddress) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION email_rdomain_cmp(EmailAddress, EmailAddress) RETURNS int4
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+
+CREATE OPERATOR ~<~ (
+   leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_rdomain_lt,
+   commutator = ~>~ , negator = ~>=~ ,
+   restrict = scalarltsel, join = scalarltjoinsel
+);
+CREATE OPERATOR ~<=~ (
+   leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_rdomain_le,
+   commutator = ~>=~ , negator = ~>~ ,
+   restrict = scalarltsel, join = scalarltjoinsel
+);
+CREATE OPERATOR ~>=~ (
+   leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_rdomain_ge,
+   commutator = ~<=~ , negator = ~<~ ,
+   restrict = scalargtsel, join = scalargtjoinsel
+);
+CREATE OPERATOR ~>~ (
+   leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_rdomain_gt,
+   commutator = ~<~ , negator = ~<=~ ,
+   restrict = scalargtsel, join = scalargtjoinsel
+);
+
+CREATE OPERATOR CLASS email_rdomain_ops
+    FOR TYPE EmailAddress USING btree AS
+        OPERATOR        1       ~<~ ,
+        OPERATOR        2       ~<=~ ,
+        OPERATOR        3       = ,
+        OPERATOR        4       ~>=~ ,
+        OPERATOR        5       ~>~ ,
+        FUNCTION        1       email_rdomain_cmp(EmailAddress, EmailAddress);
+
+-- x <@ 'unsw.edu.au' is true for addresses at unsw.edu.au or below it
+CREATE FUNCTION email_within_support(internal) RETURNS internal
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_within(EmailAddress, text) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+   SUPPORT email_within_support;
+-- estimated from the domain statistics, histogram included
+CREATE FUNCTION email_within_sel(internal, oid, internal, int4) RETURNS float8
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR <@ (
+   leftarg = EmailAddress, rightarg = text, procedure = email_within,
+   restrict = email_within_sel, join = contjoinsel
+);
+
+CREATE INDEX test_eml_rdomain_ind ON test_email
+   USING btree(y email_rdomain_ops);
+
+SELECT email_reverse_domain(x), x FROM test_email ORDER BY x USING ~<~;
+SELECT * from test_email where y <@ 'unsw.edu.au';
+EXPLAIN (COSTS OFF) SELECT * from test_email where y <@ 'unsw.edu.au';
+
+-----------------------------
+-- Prefix matching and an SP-GiST index:
+--	x ^@ 'j@unsw.edu.au' is true for addresses at unsw.edu.au whose local
+--	part starts with "j".  email_spgist_ops (needs PostgreSQL 11 or later)
+--	is a radix tree keyed on the reversed domain followed by the local
+--	part, so one index serves =, ~, <@ and ^@.  Addresses at the same
+--	domain share the inner nodes that spell it.
+--
+--	A plain email_ops btree serves ^@ too: the addresses at one domain
+--	whose local part starts with "j" are a range in that order, and the
+--	support function (PostgreSQL 12 or later) hands the planner its two
+--	bounds for the index, with ^@ kept as the recheck.
+-----------------------------
+
+CREATE FUNCTION email_starts_with_support(internal) RETURNS internal
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION email_starts_with(EmailAddress, text) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+   SUPPORT email_starts_with_support;
+
+CREATE OPERATOR ^@ (
+   leftarg = EmailAddress, rightarg = text, procedure = email_starts_with,
+   restrict = contsel, join = contjoinsel
+);
+
+-- an Index Cond on test_eml_ind, with a Filter on the ^@
+SET enable_seqscan = off;
+EXPLAIN (COSTS OFF) SELECT * from test_email where x ^@ 'j@cse.unsw.edu.au';
+SELECT * from test_email where x ^@ 'j@cse.unsw.edu.au';
+RESET enable_seqscan;
+
+CREATE FUNCTION email_spg_config(internal, internal) RETURNS void
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_spg_choose(internal, internal) RETURNS void
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_spg_inner_consistent(internal, internal) RETURNS void
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_spg_leaf_consistent(internal, internal) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_spg_compress(internal) RETURNS internal
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- splitting works on the text keys, so the built-in text one is used
+CREATE OPERATOR CLASS email_spgist_ops
+    FOR TYPE EmailAddress USING spgist AS
+        OPERATOR        1       = ,
+        OPERATOR        2       ~ ,
+        OPERATOR        3       <@ (EmailAddress, text) ,
+        OPERATOR        4       ^@ (EmailAddress, text) ,
+        FUNCTION        1       email_spg_config(internal, internal),
+        FUNCTION        2       email_spg_choose(internal, internal),
+        FUNCTION        3       spg_text_picksplit(internal, internal),
+        FUNCTION        4       email_spg_inner_consistent(internal, internal),
+        FUNCTION        5       email_spg_leaf_consistent(internal, internal),
+        FUNCTION        6       email_spg_compress(internal),
+        STORAGE         text;
+
+CREATE INDEX test_eml_spgist_ind ON test_email
+   USING spgist(x email_spgist_ops);
+
+SET enable_seqscan = off;
+EXPLAIN (COSTS OFF) SELECT * from test_email where x ^@ 'j@cse.unsw.edu.au';
+SELECT * from test_email where x ^@ 'j@cse.unsw.edu.au';
+SELECT * from test_email where x <@ 'unsw.edu.au';
+RESET enable_seqscan;
+
+-----------------------------
+-- Substring and fuzzy matching:
+--	x @~ 'shepherd' is a case insensitive substring test and x % 'text' a
+--	trigram similarity test, cut off at email.similarity_threshold (0.3 by
+--	default).  email_trgm_ops is a GIN operator class over the trigrams of
+--	the address, taken from the stored parts without going through
+--	email_out, which turns both into index scans.
+-----------------------------
+
+CREATE FUNCTION email_similarity(EmailAddress, text) RETURNS float4
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_similar(EmailAddress, text) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C STABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_contains(EmailAddress, text) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR % (
+   leftarg = EmailAddress, rightarg = text, procedure = email_similar,
+   restrict = contsel, join = contjoinsel
+);
+CREATE OPERATOR @~ (
+   leftarg = EmailAddress, rightarg = text, procedure = email_contains,
+   restrict = contsel, join = contjoinsel
+);
+
+CREATE FUNCTION email_gin_extract_value(EmailAddress, internal) RETURNS internal
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_gin_extract_query(text, internal, int2, internal, internal, internal, internal) RETURNS internal
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_gin_consistent(internal, int2, text, int4, internal, internal, internal, internal) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- a trigram is stored as an int4, so the keys compare with btint4cmp
+CREATE OPERATOR CLASS email_trgm_ops
+    FOR TYPE EmailAddress USING gin AS
+        OPERATOR        1       % (EmailAddress, text) ,
+        OPERATOR        2       @~ (EmailAddress, text) ,
+        FUNCTION        1       btint4cmp(int4, int4),
+        FUNCTION        2       email_gin_extract_value(EmailAddress, internal),
+        FUNCTION        3       email_gin_extract_query(text, internal, int2, internal, internal, internal, internal),
+        FUNCTION        4       email_gin_consistent(internal, int2, text, int4, internal, internal, internal, internal),
+        STORAGE         int4;
+
+CREATE INDEX test_eml_trgm_ind ON test_email
+   USING gin(y email_trgm_ops);
+
+SELECT y, email_similarity(y, 'jshepherd@unsw.edu.au') FROM test_email;
+SELECT * from test_email where y @~ 'SHEPHERD';
+SELECT * from test_email where y % 'jshepherd@unsw.edu.au';
+SET enable_seqscan = off;
+EXPLAIN (COSTS OFF) SELECT * from test_email where y @~ 'shepherd';
+RESET enable_seqscan;
+
+-- the row estimate of ~ now reflects how many addresses share the domain
+ANALYZE test_email;
+EXPLAIN SELECT * from test_email where x ~ 'any@hotmail.com';
+-- and that of <@ how many are within the domain, MCVs and histogram
+EXPLAIN SELECT * from test_email where y <@ 'edu.au';
+
+-- the domain statistics sit in the slots after the standard ones; kind
+-- 4701 holds the common domains, then the number of distinct domains and
+-- the average local part length, kind 4702 the domain histogram
+SELECT a.attname, s.stakind4, s.stavalues4, s.stanumbers4, s.stakind5, s.stavalues5
+   FROM pg_statistic s JOIN pg_attribute a
+        ON a.attrelid = s.starelid AND a.attnum = s.staattnum
+   WHERE s.starelid = 'test_email'::regclass;
+
+-----------------------------
+-- Small indexes for big append-only tables:
+--	A BRIN index keeps one summary per block range, and a bloom index one
+--	signature per row, both a tiny fraction of a btree.  The classes below
+--	only tie EmailAddress to the access methods' own support functions,
+--	with the ordering of email_ops and the hash of email_hash_ops.
+-----------------------------
+
+-- minmax: the smallest and largest address of each block range, good
+-- when the column roughly follows the insertion order
+CREATE OPERATOR CLASS email_minmax_ops
+    DEFAULT FOR TYPE EmailAddress USING brin AS
+        OPERATOR        1       < ,
+        OPERATOR        2       <= ,
+        OPERATOR        3       = ,
+        OPERATOR        4       >= ,
+        OPERATOR        5       > ,
+        FUNCTION        1       brin_minmax_opcinfo(internal),
+        FUNCTION        2       brin_minmax_add_value(internal, internal, internal, internal),
+        FUNCTION        3       brin_minmax_consistent(internal, internal, internal),
+        FUNCTION        4       brin_minmax_union(internal, internal, internal);
+
+-- bloom: a bloom filter of each block range, for equality probes on
+-- addresses in no particular order.  The brin_bloom functions came in
+-- PostgreSQL 14, so on older servers the class and its index are skipped.
+DO $$
+BEGIN
+	IF current_setting('server_version_num')::int >= 140000 THEN
+		EXECUTE $sql$
+			CREATE OPERATOR CLASS email_bloom_brin_ops
+			    FOR TYPE EmailAddress USING brin AS
+			        OPERATOR        1       = ,
+			        FUNCTION        1       brin_bloom_opcinfo(internal),
+			        FUNCTION        2       brin_bloom_add_value(internal, internal, internal, internal),
+			        FUNCTION        3       brin_bloom_consistent(internal, internal, internal, int4),
+			        FUNCTION        4       brin_bloom_union(internal, internal, internal),
+			        FUNCTION        5       brin_bloom_options(internal),
+			        FUNCTION        11      email_hash(EmailAddress)
+		$sql$;
+		EXECUTE $sql$
+			CREATE INDEX test_eml_brin_ind ON test_email
+			   USING brin(x email_bloom_brin_ops) WITH (pages_per_range = 32)
+		$sql$;
+	ELSE
+		RAISE NOTICE 'email_bloom_brin_ops needs PostgreSQL 14 or later, skipped';
+	END IF;
+END
+$$;
+
+-- the contrib bloom access method, one signature bit per row and
+-- column; its operator class is in email_bloom.sql, as it needs the
+-- bloom extension
+--\i email_bloom.sql
+--CREATE INDEX test_eml_bloom_ind ON test_email
+--   USING bloom(x, y);
+
+SET enable_seqscan = off;
+EXPLAIN (COSTS OFF) SELECT * from test_email where x = 'jas@cse.unsw.edu.au';
+SELECT * from test_email where x = 'jas@cse.unsw.edu.au' and y = 'john-shepherd@hotmail.com';
+RESET enable_seqscan;
+
+-----------------------------
+-- Canonical addresses:
+--	Some providers deliver mail for many spellings of one mailbox:
+--	gmail.com ignores the dots in the local part, most big providers
+--	ignore a "+tag" there, and googlemail.com is gmail.com.  The rules are
+--	built in, per domain (see email_core.c).  email_canonical gives the
+--	canonical form of an address, and email_canonical_ops compare and hash
+--	addresses by it, e.g. to find duplicates.  A +tag is only accepted at
+--	the domains whose rules drop it; elsewhere '+' is as invalid as it
+--	always was.  email_in keeps an address as it was written, tag
+--	included, so these see every row.  To pay for the rules once per row
+--	rather than once per compare, declare the column
+--	EmailAddress(canonical): whatever goes into it, from text, COPY or
+--	another column, is stored in canonical form, so plain = and a plain
+--	index find the duplicates.
+-----------------------------
+
+CREATE FUNCTION email_canonical(EmailAddress) RETURNS EmailAddress
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- postgres applies this cast to every value stored into a column with a
+-- type modifier; into an EmailAddress(canonical) column it canonicalizes.
+
+CREATE FUNCTION email_coerce(EmailAddress, integer, boolean) RETURNS EmailAddress
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE CAST (EmailAddress AS EmailAddress)
+   WITH FUNCTION email_coerce(EmailAddress, integer, boolean) AS IMPLICIT;
+
+CREATE FUNCTION email_canon_lt(EmailAddress, EmailAddress) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION email_canon_le(EmailAddress, EmailAddress) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION email_canon_eq(EmailAddress, EmailAddress) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION email_canon_ge(EmailAddress, EmailAddress) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION email_canon_gt(EmailAddress, EmailAddress) RETURNS bool
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION email_canon_cmp(EmailAddress, EmailAddress) RETURNS int4
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE LEAKPROOF;
+CREATE FUNCTION email_canon_hash(EmailAddress) RETURNS int4
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+CREATE FUNCTION email_canon_hash_extended(EmailAddress, int8) RETURNS int8
+   AS '/srvr/ctat882/postgresql-9.3.4/src/tutorial/email' LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR #<# (
+   leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_canon_lt,
+   commutator = #># , negator = #>=# ,
+   restrict = scalarltsel, join = scalarltjoinsel
+);
+CREATE OPERATOR #<=# (
+   leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_canon_le,
+   commutator = #>=# , negator = #># ,
+   restrict = scalarltsel, join = scalarltjoinsel
+);
+CREATE OPERATOR #=# (
+   leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_canon_eq,
+   commutator = #=# ,
+   restrict = eqsel, join = eqjoinsel
+);
+CREATE OPERATOR #>=# (
+   leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_canon_ge,
+   commutator = #<=# , negator = #<# ,
+   restrict = scalargtsel, join = scalargtjoinsel
+);
+CREATE OPERATOR #># (
+   leftarg = EmailAddress, rightarg = EmailAddress, procedure = email_canon_gt,
+   commutator = #<# , negator = #<=# ,
+   restrict = scalargtsel, join = scalargtjoinsel
+);
+
+CREATE OPERATOR CLASS email_canonical_ops
+    FOR TYPE EmailAddress USING btree AS
+        OPERATOR        1       #<# ,
+        OPERATOR        2       #<=# ,
+        OPERATOR        3       #=# ,
+        OPERATOR        4       #>=# ,
+        OPERATOR        5       #># ,
+        FUNCTION        1       email_canon_cmp(EmailAddress, EmailAddress);
+
+CREATE OPERATOR CLASS email_canonical_hash_ops
+    FOR TYPE EmailAddress USING hash AS
+        OPERATOR        1       #=# ,
+        FUNCTION        1       email_canon_hash(EmailAddress),
+        FUNCTION        2       email_canon_hash_extended(EmailAddress, int8);
+
+SELECT email_canonical('John.Smith+promo@googlemail.com');
+SELECT 'john.smith+promo@gmail.com'::EmailAddress #=# 'johnsmith@googlemail.com';
+
+-- an index by mailbox; UNIQUE would keep out a second spelling of one
+CREATE INDEX test_eml_canon_ind ON test_email
+   USING btree(x email_canonical_ops);
+SELECT * FROM test_email WHERE x #=# 'johnasheph.erd@googlemail.com';
+
+-- or canonicalize once, at insert time, and use plain =
+CREATE TABLE test_mailbox (
+   x  EmailAddress(canonical)
+);
+INSERT INTO test_mailbox
+   VALUES ('John.Smith+promo@gmail.com'), ('johnsmith@googlemail.com');
+INSERT INTO test_mailbox SELECT x FROM test_email;
+SELECT x, count(*) FROM test_mailbox GROUP BY x;
+
+-----------------------------
+-- Building large indexes:
+--	CREATE INDEX sorts the column with email_sortsupport.  Most compares
+--	are done on the abbreviated integer keys, and a dictionary domain
+--	(email.encode_domains) only costs a byte of the key, so a column of
+--	gmail.com and yahoo.com addresses still abbreviates well.  The sort
+--	holds the packed values, a few bytes more than the addresses' text,
+--	so maintenance_work_mem goes about as far as it does for a text
+--	column.  All the support functions are PARALLEL SAFE, which lets the
+--	build use max_parallel_maintenance_workers (PostgreSQL 11 or later);
+--	the workers share maintenance_work_mem, and spill to temp files once
+--	it is used up.  There is no separate build mode: this is what every
+--	btree build on email_ops does.  "make bench" (email_bench.sql) times
+--	the serial and parallel builds against the same addresses as text,
+--	and reports the memory or disk each sort took.
+-----------------------------
+
+-----------------------------
+-- Upgrading existing data:
+--	A database created with the old fixed size layout keeps working as is.
+--	To shrink it, let the type use short headers and repack each column
+--	(ALTER TYPE ... SET needs PostgreSQL 13 or later), then rewrite the
+--	table so that it and its indexes pick up the smaller tuples.
+-----------------------------
+
+--ALTER TYPE EmailAddress SET (STORAGE = main);
+--UPDATE test_email SET x = email_upgrade(x), y = email_upgrade(y);
+--VACUUM FULL test_email;
+
+-- functions created by an older version of this file are not marked
+-- PARALLEL SAFE; email_parallel.sql marks them
+--\i email_parallel.sql
+
 -- clean up the example
 DROP TABLE test_email;
+DROP TABLE test_mailbox;
 DROP TYPE EmailAddress CASCADE;
@@ -0,0 +1,179 @@
+---------------------------------------------------------------------------
+--
+-- email_bench.sql-
+--    Times the EmailAddress kernels on a generated data set.  Run it with
+--    "make bench", which loads email.sql into a scratch database first.
+--
+--    psql variables:
+--      rows      number of addresses (default 1000000)
+--      binfile   server side file for the binary COPY (default
+--                /tmp/email_bench.bin; COPY to a file needs superuser or
+--                pg_write_server_files)
+--      mwm       maintenance_work_mem and work_mem for the sorts and
+--                index builds (default 64MB)
+--
+--    Each line of the report is one query over the data set.  ns_per_op
+--    is the query time divided by its row count, so it includes the scan
+--    and executor overhead; the "scan" line is that overhead on its own.
+--    The sort lines also give the sort's method and the memory it used,
+--    or the disk it spilled to, as EXPLAIN ANALYZE reports them.  The
+--    index builds run with trace_sort on, so their own sort memory and
+--    spill are printed as LOG lines along the way.
+--
+---------------------------------------------------------------------------
+
+\set ON_ERROR_STOP on
+\if :{?rows}
+\else
+\set rows 1000000
+\endif
+\if :{?binfile}
+\else
+\set binfile /tmp/email_bench.bin
+\endif
+\if :{?mwm}
+\else
+\set mwm 64MB
+\endif
+
+SET client_min_messages = warning;
+
+CREATE TABLE bench_result (
+	seq		serial,
+	kernel		text,
+	rows		bigint,
+	ms		float8,
+	bytes_per_row	float8,
+	sort_method	text,
+	sort_kb		bigint
+);
+
+-- runs query once and records how long it took, per row
+CREATE FUNCTION bench(kernel text, query text, nrows bigint,
+                      nbytes bigint DEFAULT NULL) RETURNS void AS $$
+DECLARE
+	t0 timestamptz;
+BEGIN
+	t0 := clock_timestamp();
+	EXECUTE query;
+	INSERT INTO bench_result (kernel, rows, ms, bytes_per_row)
+	VALUES (kernel, nrows,
+	        extract(epoch FROM clock_timestamp() - t0) * 1000,
+	        nbytes::float8 / nrows);
+END;
+$$ LANGUAGE plpgsql;
+
+-- runs a query with one sort in it under EXPLAIN ANALYZE, and records its
+-- time along with how the sort went
+CREATE FUNCTION bench_sort(kernel text, query text, nrows bigint) RETURNS void AS $$
+DECLARE
+	plan json;
+	node json;
+BEGIN
+	EXECUTE 'EXPLAIN (ANALYZE, TIMING OFF, FORMAT JSON) ' || query INTO plan;
+	node := plan->0->'Plan';
+	WHILE node->>'Node Type' <> 'Sort' LOOP
+		node := node->'Plans'->0;
+	END LOOP;
+	INSERT INTO bench_result (kernel, rows, ms, sort_method, sort_kb)
+	VALUES (kernel, nrows, (plan->0->>'Execution Time')::float8,
+	        (node->>'Sort Method') || ', ' || (node->>'Sort Space Type'),
+	        (node->>'Sort Space Used')::bigint);
+END;
+$$ LANGUAGE plpgsql;
+
+-- the data: most addresses are at a few big providers, the rest spread
+-- over a long tail of company domains, roughly as in a real user table
+CREATE TABLE bench_src AS
+	SELECT i AS id,
+	       (ARRAY['john', 'mary', 'wei', 'ana', 'raj', 'olga', 'li', 'sam'])
+	           [1 + i % 8] || '.' ||
+	       (ARRAY['smith', 'nguyen', 'garcia', 'kumar', 'muller', 'tanaka'])
+	           [1 + (i / 8) % 6] || (i % 997) || '@' ||
+	       CASE WHEN r < 0.7 THEN
+	           (ARRAY['gmail.com', 'yahoo.com', 'hotmail.com', 'outlook.com',
+	                  'aol.com', 'icloud.com', 'gmx.de', 'mail.ru'])
+	               [1 + floor(8 * (r / 0.7) ^ 2)::int]
+	       ELSE 'mail' || floor(100000 * ((r - 0.7) / 0.3) ^ 3)::int ||
+	            '.example.com'
+	       END AS t
+	FROM (SELECT i, random() AS r FROM generate_series(1, :rows) i) s;
+
+CREATE TABLE bench_email AS
+	SELECT id, t::EmailAddress AS x FROM bench_src;
+CREATE TABLE bench_pair AS
+	SELECT a.x AS x, b.x AS y
+	FROM bench_email a JOIN bench_email b ON b.id = a.id + 1;
+CREATE TABLE bench_probe AS
+	SELECT x FROM bench_email ORDER BY random() LIMIT 100000;
+CREATE TABLE bench_recv (id int, x EmailAddress);
+VACUUM ANALYZE bench_src, bench_email, bench_pair, bench_probe;
+
+SELECT bench('scan', 'SELECT count(t) FROM bench_src', :rows);
+SELECT bench('email_in', 'SELECT count(t::EmailAddress) FROM bench_src', :rows,
+             pg_relation_size('bench_email'));
+SELECT bench('email_out', 'SELECT count(email_out(x)) FROM bench_email', :rows);
+SELECT bench('email_text', 'SELECT count(x::text) FROM bench_email', :rows);
+SELECT bench('email_send', 'SELECT count(email_send(x)) FROM bench_email', :rows);
+SELECT bench('copy binary out (email_send)',
+             format('COPY bench_email TO %L (FORMAT binary)', :'binfile'), :rows);
+SELECT bench('copy binary in (email_recv)',
+             format('COPY bench_recv FROM %L (FORMAT binary)', :'binfile'), :rows);
+SELECT bench('email_cmp', 'SELECT count(email_cmp(x, y)) FROM bench_pair',
+             :rows - 1);
+SELECT bench('email_hash', 'SELECT count(email_hash(x)) FROM bench_email', :rows);
+
+-- sorts and index builds, against the same addresses as text in the C
+-- collation, which compares bytes much like email_ops does
+SET work_mem = :'mwm';
+SET maintenance_work_mem = :'mwm';
+SET max_parallel_workers_per_gather = 0;
+SELECT bench_sort('sort (sortsupport)',
+                  'SELECT x FROM bench_email ORDER BY x', :rows);
+SELECT bench_sort('sort, text',
+                  'SELECT t FROM bench_src ORDER BY t COLLATE "C"', :rows);
+RESET max_parallel_workers_per_gather;
+
+SET trace_sort = on;
+SET client_min_messages = log;
+SET max_parallel_maintenance_workers = 0;
+SELECT bench('create index, serial',
+             'CREATE INDEX bench_email_ind ON bench_email (x)', :rows);
+UPDATE bench_result SET bytes_per_row = pg_relation_size('bench_email_ind')::float8 / rows
+	WHERE seq = currval('bench_result_seq_seq');
+SELECT bench('create index, serial, text',
+             'CREATE INDEX bench_text_ind ON bench_src (t COLLATE "C")', :rows);
+UPDATE bench_result SET bytes_per_row = pg_relation_size('bench_text_ind')::float8 / rows
+	WHERE seq = currval('bench_result_seq_seq');
+DROP INDEX bench_email_ind, bench_text_ind;
+RESET max_parallel_maintenance_workers;
+SELECT bench('create index, parallel',
+             'CREATE INDEX bench_email_ind ON bench_email (x)', :rows);
+SELECT bench('create index, parallel, text',
+             'CREATE INDEX bench_text_ind ON bench_src (t COLLATE "C")', :rows);
+SET client_min_messages = warning;
+RESET trace_sort;
+RESET work_mem;
+RESET maintenance_work_mem;
+
+-- one index probe per row of bench_probe
+SET enable_hashjoin = off;
+SET enable_mergejoin = off;
+SET enable_seqscan = off;
+SELECT bench('index lookup (=)',
+             'SELECT count(*) FROM bench_probe p JOIN bench_email b ON b.x = p.x',
+             100000);
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+RESET enable_seqscan;
+
+SELECT kernel, rows,
+       round(ms::numeric, 1) AS ms,
+       round((ms * 1000000 / rows)::numeric, 1) AS ns_per_op,
+       round(bytes_per_row::numeric, 1) AS bytes_per_row,
+       sort_method, sort_kb
+FROM bench_result ORDER BY seq;
+
+SELECT avg(pg_column_size(x))::numeric(6, 1) AS avg_value_bytes,
+       avg(octet_length(t))::numeric(6, 1) AS avg_text_bytes
+FROM bench_email JOIN bench_src USING (id);
@@ -0,0 +1,23 @@
+---------------------------------------------------------------------------
+--
+-- email_bloom.sql-
+--    Adds a bloom index operator class for EmailAddress, for the contrib
+--    bloom access method: one signature per row, built from email_hash,
+--    that answers = on any combination of the indexed columns.  It is
+--    kept out of email.sql so that the tutorial does not depend on
+--    contrib/bloom; run it after email.sql where bloom is installed.
+--
+---------------------------------------------------------------------------
+
+\set ON_ERROR_STOP on
+
+CREATE EXTENSION IF NOT EXISTS bloom;
+
+CREATE OPERATOR CLASS email_bloom_ops
+    DEFAULT FOR TYPE EmailAddress USING bloom AS
+        OPERATOR        1       = ,
+        FUNCTION        1       email_hash(EmailAddress);
+
+-- e.g. on the tutorial's table
+--CREATE INDEX test_eml_bloom_ind ON test_email
+--   USING bloom(x, y);
@@ -0,0 +1,404 @@
+/*
+ * email_core.c
+ *
+ ******************************************************************************
+  Parsing and comparison of email addresses, independent of the backend.
+  See email_core.h.
+******************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "email_core.h"
+
+#define Min(x, y)  ((x) < (y) ? (x) : (y))
+
+
+/**
+   Verify that email address rules are satisfied for local.
+   The local part is one or more dot separated labels.
+   @PARAMS local: The string to validate.
+   @RETURN: Returns TRUE (1) if the string is valid,
+            FALSE (0) otherwise. 
+*/
+int checkLocalIsValid (char *local) {
+	return checkLabelSequence(local, 1);
+}
+
+
+/**
+   Verify that email address rules are satisfied for domain.
+   The domain is two or more dot separated labels.
+   @PARAMS domain: The string to validate.
+   @RETURN: Returns TRUE (1) if the string is valid,
+            FALSE (0) otherwise. 
+*/
+int checkDomainIsValid (char *domain) {
+	return checkLabelSequence(domain, 2);
+}
+
+/*
+ * Character classes.  Every byte of an address is looked up once in
+ * email_char_class, indexed as an unsigned char, so that bytes above 127
+ * are simply invalid whatever the signedness of char.  The label DFA is
+ * then a table indexed by state and class, with no compares on the byte
+ * itself.  Local part and domain allow the same characters; '@' is only
+ * valid as the separator, which the parser deals with before the DFA.
+ */
+#define CHAR_INVALID  0
+#define CHAR_ALPHA    1     // 'a'..'z', 'A'..'Z'
+#define CHAR_DIGIT    2     // '0'..'9'
+#define CHAR_HYPHEN   3     // '-'
+#define CHAR_DOT      4     // '.', the label separator
+#define CHAR_AT       5     // '@', the part separator
+#define CHAR_NCLASSES 6
+
+static const unsigned char email_char_class[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0x00 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0x10 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 4, 0,  /* 0x20 */
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0,  /* 0x30 */
+	5, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0x40 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,  /* 0x50 */
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0x60 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,  /* 0x70 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0x80 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0x90 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0xa0 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0xb0 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0xc0 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0xd0 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0xe0 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0xf0 */
+};
+
+#define CHAR_CLASS(c)  (email_char_class[(unsigned char) (c)])
+
+/* States of the label validator */
+#define LABEL_REJECT  -1    // the string can no longer match
+#define LABEL_START   0     // at the start of a label, need a letter
+#define LABEL_ALNUM   1     // last character was a letter or digit
+#define LABEL_HYPHEN  2     // last character was a '-'
+
+/*
+ * The DFA for the label rules the validators used to express as the
+ * regular expression
+ *     [a-z]([-]*[a-z0-9])*([.][a-z]([-]*[a-z0-9])*)*
+ * (case insensitive): every label starts with a letter, continues with
+ * letters, digits and hyphens, and does not end with a hyphen.  A string
+ * matches if the DFA finishes in LABEL_ALNUM.
+ */
+static const signed char label_next[3][CHAR_NCLASSES] = {
+	/*               invalid       alpha        digit         hyphen        dot           at */
+	/* START  */ {LABEL_REJECT, LABEL_ALNUM, LABEL_REJECT, LABEL_REJECT, LABEL_REJECT, LABEL_REJECT},
+	/* ALNUM  */ {LABEL_REJECT, LABEL_ALNUM, LABEL_ALNUM,  LABEL_HYPHEN, LABEL_START,  LABEL_REJECT},
+	/* HYPHEN */ {LABEL_REJECT, LABEL_ALNUM, LABEL_ALNUM,  LABEL_HYPHEN, LABEL_REJECT, LABEL_REJECT},
+};
+
+/**
+	Runs the label DFA over a null terminated string.
+	@PARAMS  string: The string to check.
+	         min_labels: The least number of labels required.
+	@RETURN: TRUE (1) if the string matches, otherwise FALSE (0).
+*/
+int checkLabelSequence (const char *string, int min_labels) {
+	int state = LABEL_START;
+	int labels = 1;
+	const char *p;
+
+	for (p = string; *p && state != LABEL_REJECT; p++) {
+		int cc = CHAR_CLASS(*p);
+
+		state = label_next[state][cc];
+		labels += (cc == CHAR_DOT);
+	}
+	return (state == LABEL_ALNUM && labels >= min_labels);
+}
+
+/**
+	Parses the text form of an EmailAddress in one scan.  Every byte is
+	looked at once: it is checked against the allowed character set, fed
+	to the label DFA of the part it belongs to, and the single '@' that
+	separates the parts is located on the way.
+	@PARAMS  str: The null terminated input.
+	         parse: Filled in with the part lengths, or the error position.
+	@RETURN: EMAIL_PARSE_OK, or the reason the string was rejected.
+*/
+EmailParseStatus parseEmailAddress (const char *str, EmailParse *parse) {
+	const char *p;
+	const char *at = NULL;
+	int state = LABEL_START;
+	int labels = 1;
+
+	for (p = str; *p; p++) {
+		int cc = CHAR_CLASS(*p);
+
+		parse->error_pos = p - str;
+		if (cc == CHAR_INVALID)
+			return EMAIL_PARSE_INVALID_CHAR;
+		if (cc == CHAR_AT) {
+			if (at != NULL) return EMAIL_PARSE_INVALID_CHAR;
+			if (p == str) return EMAIL_PARSE_NO_LOCAL;
+			if (state != LABEL_ALNUM) return EMAIL_PARSE_BAD_LOCAL;
+			at = p;
+			state = LABEL_START;
+			labels = 1;
+			continue;
+		}
+		state = label_next[state][cc];
+		if (state == LABEL_REJECT)
+			return at ? EMAIL_PARSE_BAD_DOMAIN : EMAIL_PARSE_BAD_LOCAL;
+		labels += (cc == CHAR_DOT);
+	}
+
+	parse->error_pos = p - str;
+	if (at == NULL || p == at + 1)
+		return EMAIL_PARSE_NO_DOMAIN;
+	if (state != LABEL_ALNUM || labels < 2)
+		return EMAIL_PARSE_BAD_DOMAIN;
+
+	parse->local_len = at - str;
+	parse->domain_len = p - (at + 1);
+	if (parse->local_len >= MAX_CHARS || parse->domain_len >= MAX_CHARS)
+		return EMAIL_PARSE_TOO_LONG;
+	return EMAIL_PARSE_OK;
+}
+
+/**
+	Parses the text form of an EmailAddress as the input functions take
+	it.  That is parseEmailAddress, except that at a domain whose rules
+	ignore tags (EMAIL_CANON_TAGS) the local part may end in one: a '+'
+	and then runs of letters and digits separated by single '-' or '.'
+	characters.  The address without its tag must be valid as it stands,
+	and anything rejected is rejected with the status and position
+	parseEmailAddress gave, so the grammar of every other domain is
+	exactly the original one.
+	@PARAMS  str: The null terminated input.
+	         parse: as for parseEmailAddress; local_len includes the tag.
+	@RETURN: EMAIL_PARSE_OK, or the reason the string was rejected.
+*/
+EmailParseStatus parseEmailInput (const char *str, EmailParse *parse) {
+	EmailParseStatus status = parseEmailAddress(str, parse);
+	char		untagged[2 * MAX_CHARS];
+	const char *plus, *at, *canon_domain;
+	int			canon_domain_len, run = 0;
+	EmailParse	base;
+
+	// only the '+' the parser stopped at can start a tag
+	if (status != EMAIL_PARSE_INVALID_CHAR || str[parse->error_pos] != '+')
+		return status;
+	plus = str + parse->error_pos;
+	for (at = plus + 1; *at && *at != '@'; at++) {
+		int cc = CHAR_CLASS(*at);
+
+		if (cc == CHAR_ALPHA || cc == CHAR_DIGIT)
+			run++;
+		else if ((cc == CHAR_HYPHEN || cc == CHAR_DOT) && run > 0)
+			run = 0;
+		else
+			return status;
+	}
+	if (*at != '@' || run == 0 || (plus - str) + strlen(at) >= sizeof(untagged))
+		return status;
+
+	memcpy(untagged, str, plus - str);
+	strcpy(untagged + (plus - str), at);
+	if (parseEmailAddress(untagged, &base) != EMAIL_PARSE_OK ||
+	    !(email_canon_policy(at + 1, base.domain_len,
+	                         &canon_domain, &canon_domain_len) & EMAIL_CANON_TAGS))
+		return status;
+
+	parse->local_len = at - str;
+	parse->domain_len = base.domain_len;
+	if (parse->local_len >= MAX_CHARS) {
+		parse->error_pos = parse->local_len + 1 + parse->domain_len;
+		return EMAIL_PARSE_TOO_LONG;
+	}
+	return EMAIL_PARSE_OK;
+}
+
+/**
+	Describes a parse failure, for trace and error output.
+*/
+const char *parseStatusMessage (EmailParseStatus status) {
+	switch (status) {
+		case EMAIL_PARSE_OK:           return "Valid";
+		case EMAIL_PARSE_NO_LOCAL:     return "No Local";
+		case EMAIL_PARSE_NO_DOMAIN:    return "No Domain";
+		case EMAIL_PARSE_INVALID_CHAR: return "Invalid Character";
+		case EMAIL_PARSE_BAD_LOCAL:    return "Invalid Local";
+		case EMAIL_PARSE_BAD_DOMAIN:   return "Invalid Domain";
+		case EMAIL_PARSE_TOO_LONG:     return "Too Long";
+	}
+	return "Unknown";
+}
+
+/**
+   Checks a character against the set allowed in an address: letters,
+   digits, '-', '.' and '@'.
+   @PARAMS c: the character to check.
+   @RETURN: Returns TRUE (1) if character is valid,
+            FALSE (0) otherwise.
+*/
+int isValidCharacter (char c) {
+	return CHAR_CLASS(c) != CHAR_INVALID;
+}
+
+
+/*
+ * Eight byte variant of ASCII_TOLOWER, see swarFoldAscii.
+ */
+#define SWAR_ONES   UINT64_C(0x0101010101010101)
+#define SWAR_HIGHS  UINT64_C(0x8080808080808080)
+
+/**
+   Lower cases the ASCII letters in eight packed bytes at once.  Adding
+   0x80 - 'A' to the low seven bits of a byte sets its high bit iff the
+   byte is >= 'A', adding 0x80 - 'Z' - 1 sets it iff the byte is > 'Z';
+   the two differ exactly for upper case letters, which then get 0x20
+   or'ed in.  Bytes with the high bit already set are left as they are.
+*/
+static inline uint64_t swarFoldAscii (uint64_t w) {
+	uint64_t heptets = w & ~SWAR_HIGHS;
+	uint64_t ge_A = heptets + SWAR_ONES * (0x80 - 'A');
+	uint64_t gt_Z = heptets + SWAR_ONES * (0x80 - 'Z' - 1);
+	uint64_t upper = (ge_A ^ gt_Z) & ~w & SWAR_HIGHS;
+
+	return w | (upper >> 2);
+}
+
+/**
+   Case insensitive comparison of two strings that are not null terminated.
+   Works through the common length a word at a time, and only drops to
+   single bytes to settle the word where the strings first differ.
+   @RETURN: <0, 0 or >0 in the manner of strcasecmp.
+*/
+int parts_casecmp (const char *a, int a_len, const char *b, int b_len)
+{
+	int n = Min(a_len, b_len);
+	int i = 0;
+
+	for (; i + (int) sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+		uint64_t wa, wb;
+
+		memcpy(&wa, a + i, sizeof(uint64_t));
+		memcpy(&wb, b + i, sizeof(uint64_t));
+		if (wa != wb && swarFoldAscii(wa) != swarFoldAscii(wb))
+			break;
+	}
+	for (; i < n; i++) {
+		unsigned char ca = ASCII_TOLOWER((unsigned char) a[i]);
+		unsigned char cb = ASCII_TOLOWER((unsigned char) b[i]);
+
+		if (ca != cb)
+			return (int) ca - (int) cb;
+	}
+	return a_len - b_len;
+}
+
+/**
+   Byte wise comparison of two strings that are not null terminated.  Same
+   result as parts_casecmp when both strings are already lower case.
+*/
+int parts_memcmp (const char *a, int a_len, const char *b, int b_len)
+{
+	int result = memcmp(a, b, Min(a_len, b_len));
+
+	if (result == 0)
+		result = a_len - b_len;
+	return result;
+}
+
+/*
+ * The canonicalization rules, one per domain, sorted the way parts_memcmp
+ * sorts.  An alias domain is the same mailbox provider under another
+ * name, and takes the policy of its target.  email_canonical and the
+ * email_canonical_ops opclasses depend on this table, so changing a rule
+ * means reindexing those indexes.
+ */
+typedef struct EmailCanonRule
+{
+	const char *domain;
+	int			domain_len;
+	int			policy;              // EMAIL_CANON_* bits
+	const char *alias;               // the domain this one stands for, or NULL
+}	EmailCanonRule;
+
+#define CANON_RULE(name, policy)    { name, sizeof(name) - 1, policy, NULL }
+#define CANON_ALIAS(name, target)   { name, sizeof(name) - 1, 0, target }
+
+static const EmailCanonRule email_canon_rules[] = {
+	CANON_RULE("fastmail.com", EMAIL_CANON_TAGS),
+	CANON_RULE("gmail.com", EMAIL_CANON_DOTS | EMAIL_CANON_TAGS),
+	CANON_ALIAS("googlemail.com", "gmail.com"),
+	CANON_RULE("hotmail.com", EMAIL_CANON_TAGS),
+	CANON_RULE("icloud.com", EMAIL_CANON_TAGS),
+	CANON_RULE("live.com", EMAIL_CANON_TAGS),
+	CANON_RULE("outlook.com", EMAIL_CANON_TAGS),
+	CANON_RULE("proton.me", EMAIL_CANON_TAGS),
+	CANON_RULE("protonmail.com", EMAIL_CANON_TAGS),
+};
+
+#define EMAIL_NUM_CANON_RULES  ((int) (sizeof(email_canon_rules) / sizeof(email_canon_rules[0])))
+
+static const EmailCanonRule *canonRuleLookup (const char *domain, int domain_len) {
+	int lo = 0, hi = EMAIL_NUM_CANON_RULES - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		int r = parts_casecmp(domain, domain_len,
+		                      email_canon_rules[mid].domain, email_canon_rules[mid].domain_len);
+
+		if (r == 0)
+			return &email_canon_rules[mid];
+		if (r < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+/**
+   Looks up the canonicalization rule of a domain.
+   @PARAMS domain: the domain, any case, not null terminated.
+           canon_domain, canon_domain_len: set to the canonical domain,
+             which is the domain itself unless it is an alias.
+   @RETURN: the EMAIL_CANON_* policy of the domain, 0 if it has none.
+*/
+int email_canon_policy (const char *domain, int domain_len,
+                        const char **canon_domain, int *canon_domain_len) {
+	const EmailCanonRule *rule = canonRuleLookup(domain, domain_len);
+
+	*canon_domain = domain;
+	*canon_domain_len = domain_len;
+	if (rule != NULL && rule->alias != NULL) {
+		*canon_domain = rule->alias;
+		*canon_domain_len = strlen(rule->alias);
+		rule = canonRuleLookup(rule->alias, *canon_domain_len);
+	}
+	return rule ? rule->policy : 0;
+}
+
+/**
+   Writes the canonical form of a local part under a policy.  It is never
+   longer than the local part, and dst may be the local part itself.
+   @PARAMS local: the local part, not null terminated.
+           policy: EMAIL_CANON_* bits, from email_canon_policy.
+           dst: room for local_len bytes.
+   @RETURN: the length of the canonical local part.
+*/
+int email_canonical_local (const char *local, int local_len, int policy, char *dst) {
+	int i, n = 0;
+
+	for (i = 0; i < local_len; i++) {
+		char c = local[i];
+
+		if (c == '+' && (policy & EMAIL_CANON_TAGS))
+			break;
+		if (c == '.' && (policy & EMAIL_CANON_DOTS))
+			continue;
+		dst[n++] = c;
+	}
+	return n;
+}
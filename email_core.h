@@ -0,0 +1,80 @@
+/*
+ * email_core.h
+ *
+ ******************************************************************************
+  The parts of the EmailAddress type that do not need a backend: parsing
+  the text form, the label rules and the case insensitive comparison of
+  address parts.  email.c builds the type on top of these, and
+  email_harness.c links them on their own, so the kernels can be timed,
+  profiled and fuzzed without a running postgres.
+
+  Nothing here may include postgres.h or allocate memory.
+******************************************************************************/
+
+#ifndef EMAIL_CORE_H
+#define EMAIL_CORE_H
+
+#define MAX_CHARS  128
+#define TRUE 1
+#define FALSE 0
+
+/*
+ * Case folding.  Addresses are plain ASCII, so folding only ever maps
+ * 'A'..'Z' to 'a'..'z'.  Everything that compares or hashes addresses uses
+ * this same folding, one byte at a time with ASCII_TOLOWER or eight bytes
+ * at a time with swarFoldAscii.
+ */
+#define ASCII_ISUPPER(c)  ((c) >= 'A' && (c) <= 'Z')
+#define ASCII_TOLOWER(c)  (ASCII_ISUPPER(c) ? (c) + ('a' - 'A') : (c))
+
+/*
+ * Outcome of parsing the text form of an EmailAddress.
+ */
+typedef enum EmailParseStatus
+{
+	EMAIL_PARSE_OK = 0,
+	EMAIL_PARSE_NO_LOCAL,        // nothing before the '@'
+	EMAIL_PARSE_NO_DOMAIN,       // no '@', or nothing after it
+	EMAIL_PARSE_INVALID_CHAR,    // a character outside the allowed set, or a second '@'
+	EMAIL_PARSE_BAD_LOCAL,       // the local part breaks the label rules
+	EMAIL_PARSE_BAD_DOMAIN,      // the domain breaks the label rules
+	EMAIL_PARSE_TOO_LONG         // a part does not fit in MAX_CHARS - 1 bytes
+}	EmailParseStatus;
+
+/*
+ * Where the parts of a parsed address are in the input string.  The local
+ * part starts at offset 0 and the domain at local_len + 1.
+ */
+typedef struct EmailParse
+{
+	int			local_len;
+	int			domain_len;
+	int			error_pos;           // offset of the offending byte on failure
+}	EmailParse;
+
+/*
+ * Canonicalization policies.  Some providers deliver mail for many
+ * spellings of the same mailbox; email_canon_policy says which parts of
+ * an address at a domain are not significant there.  The input functions
+ * also accept a +tag at domains that have EMAIL_CANON_TAGS, see
+ * parseEmailInput.
+ */
+#define EMAIL_CANON_DOTS  0x01   // dots in the local part are ignored
+#define EMAIL_CANON_TAGS  0x02   // a '+' starts a tag, ignored up to the '@'
+
+/* Function Prototypes */
+
+int isValidCharacter (char c);
+EmailParseStatus parseEmailAddress (const char *str, EmailParse *parse);
+EmailParseStatus parseEmailInput (const char *str, EmailParse *parse);
+const char *parseStatusMessage (EmailParseStatus status);
+int checkLocalIsValid (char *local);
+int checkDomainIsValid (char *domain);
+int checkLabelSequence (const char *string, int min_labels);
+int parts_memcmp (const char *a, int a_len, const char *b, int b_len);
+int parts_casecmp (const char *a, int a_len, const char *b, int b_len);
+int email_canon_policy (const char *domain, int domain_len,
+                        const char **canon_domain, int *canon_domain_len);
+int email_canonical_local (const char *local, int local_len, int policy, char *dst);
+
+#endif							/* EMAIL_CORE_H */
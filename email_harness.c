@@ -0,0 +1,347 @@
+/*
+ * email_harness.c
+ *
+ ******************************************************************************
+  A standalone driver for the kernels in email_core.c, with no backend
+  involved.  It checks them against reference versions, times them, and
+  doubles as a libFuzzer target:
+
+      make email_harness
+      ./email_harness check < addresses.txt    one address per line
+      ./email_harness bench [count]            ns/op of each kernel
+      perf stat ./email_harness bench
+
+      make email_fuzz                          needs clang
+      ./email_fuzz
+
+  The reference parser is the validation email_in did before it had its
+  own DFA: the original character check and the original regular
+  expressions, run through regcomp.  Any rewrite of the parser has to
+  agree with it on every input, which is what "check" and the fuzzer
+  assert.  parseEmailInput, which also takes a +tag at the domains whose
+  rules drop it, is checked against that same reference, with the tag
+  matched by a pattern of its own.
+******************************************************************************/
+
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "email_core.h"
+
+/* The label patterns email_in used to match the parts with */
+#define REF_LOCAL_PATTERN \
+	"((^[a-zA-Z])+(([-]*[a-zA-z0-9]))*(([\\.])([a-zA-Z])+(([-]*[a-zA-z0-9]))*)*)$"
+#define REF_DOMAIN_PATTERN \
+	"((^[a-zA-Z])+(([-]*[a-zA-z0-9]))*(([\\.])([a-zA-Z])+(([-]*[a-zA-z0-9]))*)+)$"
+
+/* The tag parseEmailInput takes after the local part, without its '+' */
+#define REF_TAG_PATTERN  "^[a-zA-Z0-9]+([-.][a-zA-Z0-9]+)*$"
+
+static regex_t ref_local_regex;
+static regex_t ref_domain_regex;
+static regex_t ref_tag_regex;
+
+int LLVMFuzzerTestOneInput (const unsigned char *data, size_t size);
+
+/**
+   Compiles the reference regular expressions, once.
+*/
+static void ref_init (void) {
+	static int done = FALSE;
+
+	if (done)
+		return;
+	if (regcomp(&ref_local_regex, REF_LOCAL_PATTERN, REG_EXTENDED | REG_ICASE) ||
+	    regcomp(&ref_domain_regex, REF_DOMAIN_PATTERN, REG_EXTENDED | REG_ICASE) ||
+	    regcomp(&ref_tag_regex, REF_TAG_PATTERN, REG_EXTENDED)) {
+		fprintf(stderr, "could not compile the reference patterns\n");
+		exit(2);
+	}
+	done = TRUE;
+}
+
+/**
+   The character check as email_in first had it, a chain of ranges on
+   a plain char.
+*/
+static int ref_valid_character (char c) {
+	int valid = TRUE;
+	if ( c < 48 && c != 46 && c != 45) valid = FALSE;
+	else if (c > 57 && c < 64)	valid = FALSE;
+	else if (c > 90 && c < 97)	valid = FALSE;
+	else if (c > 122)	valid = FALSE;
+	return valid;
+}
+
+/**
+   Decides whether str is a valid address the slow, obvious way.
+   @RETURN: TRUE (1) if valid, otherwise FALSE (0).
+*/
+static int ref_parse (const char *str) {
+	char local[MAX_CHARS], domain[MAX_CHARS];
+	const char *at = strchr(str, '@');
+	size_t len = strlen(str), i;
+
+	for (i = 0; i < len; i++)
+		if (!ref_valid_character(str[i]))
+			return FALSE;
+	if (at == NULL || at == str || strchr(at + 1, '@') != NULL)
+		return FALSE;
+	if (at - str >= MAX_CHARS || len - (at - str) - 1 >= MAX_CHARS)
+		return FALSE;
+
+	memcpy(local, str, at - str);
+	local[at - str] = '\0';
+	strcpy(domain, at + 1);
+	return regexec(&ref_local_regex, local, 0, NULL, 0) == 0 &&
+		regexec(&ref_domain_regex, domain, 0, NULL, 0) == 0;
+}
+
+/**
+   Decides whether parseEmailInput should take str: the reference says
+   yes, or str is a valid address with a tag cut into its local part,
+   at a domain that has EMAIL_CANON_TAGS.  Which domains those are is
+   the rule table's business, so that is asked of email_canon_policy.
+   @RETURN: TRUE (1) if valid, otherwise FALSE (0).
+*/
+static int ref_parse_input (const char *str) {
+	char tag[2 * MAX_CHARS], untagged[2 * MAX_CHARS];
+	const char *plus = strchr(str, '+');
+	const char *at = plus ? strchr(plus, '@') : NULL;
+	const char *canon_domain;
+	int canon_domain_len;
+
+	if (ref_parse(str))
+		return TRUE;
+	if (at == NULL || strlen(str) >= sizeof(untagged) || at - str >= MAX_CHARS)
+		return FALSE;
+	memcpy(tag, plus + 1, at - plus - 1);
+	tag[at - plus - 1] = '\0';
+	memcpy(untagged, str, plus - str);
+	strcpy(untagged + (plus - str), at);
+	return regexec(&ref_tag_regex, tag, 0, NULL, 0) == 0 && ref_parse(untagged) &&
+		(email_canon_policy(at + 1, strlen(at + 1),
+		                    &canon_domain, &canon_domain_len) & EMAIL_CANON_TAGS);
+}
+
+static int sign (int x) {
+	return (x > 0) - (x < 0);
+}
+
+/**
+   Checks parts_casecmp and parts_memcmp against strncasecmp/memcmp.
+*/
+static void check_compare (const char *a, int a_len, const char *b, int b_len) {
+	int n = a_len < b_len ? a_len : b_len;
+	int expect = strncasecmp(a, b, n);
+	int expect_mem = memcmp(a, b, n);
+
+	if (expect == 0)
+		expect = a_len - b_len;
+	if (expect_mem == 0)
+		expect_mem = a_len - b_len;
+	if (sign(parts_casecmp(a, a_len, b, b_len)) != sign(expect) ||
+	    sign(parts_memcmp(a, a_len, b, b_len)) != sign(expect_mem)) {
+		fprintf(stderr, "bad comparison of \"%.*s\" and \"%.*s\"\n",
+		        a_len, a, b_len, b);
+		abort();
+	}
+}
+
+/**
+   Parses str with parseEmailInput and aborts if it disagrees with the
+   tag reference, or if its parts do not add up.
+*/
+static void check_input (const char *str) {
+	EmailParse parse;
+	EmailParseStatus status = parseEmailInput(str, &parse);
+	int len = (int) strlen(str);
+
+	if ((status == EMAIL_PARSE_OK) != ref_parse_input(str)) {
+		fprintf(stderr, "input parser and reference disagree on \"%s\": %s\n",
+		        str, parseStatusMessage(status));
+		abort();
+	}
+	if (status == EMAIL_PARSE_OK &&
+	    (parse.local_len + 1 + parse.domain_len != len || str[parse.local_len] != '@')) {
+		fprintf(stderr, "bad input part lengths for \"%s\"\n", str);
+		abort();
+	}
+	else if (status != EMAIL_PARSE_OK && (parse.error_pos < 0 || parse.error_pos > len)) {
+		fprintf(stderr, "input error position %d out of range for \"%s\"\n",
+		        parse.error_pos, str);
+		abort();
+	}
+}
+
+/**
+   Parses str with parseEmailAddress and aborts if it disagrees with the
+   reference, or if what it reports does not add up.  Then does the same
+   for parseEmailInput.
+*/
+static void check_one (const char *str) {
+	EmailParse parse;
+	EmailParseStatus status = parseEmailAddress(str, &parse);
+	int len = (int) strlen(str);
+
+	if ((status == EMAIL_PARSE_OK) != ref_parse(str)) {
+		fprintf(stderr, "parser and reference disagree on \"%s\": %s\n",
+		        str, parseStatusMessage(status));
+		abort();
+	}
+	if (status == EMAIL_PARSE_OK) {
+		char local[MAX_CHARS];
+
+		memcpy(local, str, parse.local_len);
+		local[parse.local_len] = '\0';
+		if (parse.local_len + 1 + parse.domain_len != len || str[parse.local_len] != '@' ||
+		    !checkLocalIsValid(local) || !checkDomainIsValid((char *) str + parse.local_len + 1)) {
+			fprintf(stderr, "bad part lengths for \"%s\"\n", str);
+			abort();
+		}
+		check_compare(str, parse.local_len, str + parse.local_len + 1, parse.domain_len);
+	}
+	else if (parse.error_pos < 0 || parse.error_pos > len) {
+		fprintf(stderr, "error position %d out of range for \"%s\"\n",
+		        parse.error_pos, str);
+		abort();
+	}
+	check_input(str);
+}
+
+#ifdef EMAIL_FUZZ
+
+/**
+   libFuzzer entry point.  The input is cut at its first NUL, since that
+   is all email_in ever sees of a cstring.
+*/
+int LLVMFuzzerTestOneInput (const unsigned char *data, size_t size) {
+	char *str = malloc(size + 1);
+
+	ref_init();
+	memcpy(str, data, size);
+	str[size] = '\0';
+	check_one(str);
+	check_compare(str, (int) (strlen(str) / 2), str + strlen(str) / 2,
+	              (int) (strlen(str) - strlen(str) / 2));
+	free(str);
+	return 0;
+}
+
+#else
+
+static double now_ns (void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+   Generates count addresses, most of them at a few big providers, the
+   rest over a long tail of domains, as email_bench.sql does.
+*/
+static char **make_addresses (int count) {
+	static const char *names[] = {"john", "Mary", "wei", "ana", "raj", "olga", "li", "sam"};
+	static const char *surnames[] = {"smith", "nguyen", "Garcia", "kumar", "muller", "tanaka"};
+	static const char *providers[] = {"gmail.com", "yahoo.com", "hotmail.com", "outlook.com",
+	                                  "aol.com", "icloud.com", "gmx.de", "mail.ru"};
+	char **addrs = malloc(count * sizeof(char *));
+	int i;
+
+	srand(4711);
+	for (i = 0; i < count; i++) {
+		double r = rand() / (RAND_MAX + 1.0);
+		char buf[2 * MAX_CHARS];
+
+		if (r < 0.7)
+			snprintf(buf, sizeof(buf), "%s.%s%d@%s", names[i % 8], surnames[(i / 8) % 6],
+			         i % 997, providers[(int) (8 * (r / 0.7) * (r / 0.7))]);
+		else
+			snprintf(buf, sizeof(buf), "%s.%s%d@mail%d.example.com", names[i % 8],
+			         surnames[(i / 8) % 6], i % 997,
+			         (int) (100000 * ((r - 0.7) / 0.3) * ((r - 0.7) / 0.3) * ((r - 0.7) / 0.3)));
+		addrs[i] = strdup(buf);
+	}
+	return addrs;
+}
+
+/**
+   Times each kernel over the generated addresses and prints ns/op.
+*/
+static void bench (int count) {
+	char **addrs = make_addresses(count);
+	EmailParse *parts = malloc(count * sizeof(EmailParse));
+	double t0, bytes = 0;
+	long sink = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		bytes += strlen(addrs[i]);
+
+	t0 = now_ns();
+	for (i = 0; i < count; i++)
+		sink += parseEmailAddress(addrs[i], &parts[i]);
+	printf("%-24s %8.1f ns/op  %6.1f bytes/op\n", "parseEmailAddress",
+	       (now_ns() - t0) / count, bytes / count);
+
+	t0 = now_ns();
+	for (i = 0; i < count; i++)
+		sink += isValidCharacter(addrs[i][i % parts[i].local_len]);
+	printf("%-24s %8.1f ns/op\n", "isValidCharacter", (now_ns() - t0) / count);
+
+	t0 = now_ns();
+	for (i = 1; i < count; i++) {
+		const char *a = addrs[i], *b = addrs[i - 1];
+
+		sink += parts_casecmp(a + parts[i].local_len + 1, parts[i].domain_len,
+		                      b + parts[i - 1].local_len + 1, parts[i - 1].domain_len);
+		sink += parts_casecmp(a, parts[i].local_len, b, parts[i - 1].local_len);
+	}
+	printf("%-24s %8.1f ns/op  (domain and local)\n", "parts_casecmp",
+	       (now_ns() - t0) / (count - 1));
+
+	t0 = now_ns();
+	for (i = 1; i < count; i++) {
+		const char *a = addrs[i], *b = addrs[i - 1];
+
+		sink += parts_memcmp(a + parts[i].local_len + 1, parts[i].domain_len,
+		                     b + parts[i - 1].local_len + 1, parts[i - 1].domain_len);
+		sink += parts_memcmp(a, parts[i].local_len, b, parts[i - 1].local_len);
+	}
+	printf("%-24s %8.1f ns/op  (domain and local)\n", "parts_memcmp",
+	       (now_ns() - t0) / (count - 1));
+
+	// keeps the loops from being optimised away
+	if (sink == 42)
+		printf("\n");
+}
+
+int main (int argc, char **argv) {
+	char line[4096];
+
+	ref_init();
+	if (argc >= 2 && strcmp(argv[1], "check") == 0) {
+		long n = 0;
+
+		while (fgets(line, sizeof(line), stdin)) {
+			line[strcspn(line, "\r\n")] = '\0';
+			check_one(line);
+			n++;
+		}
+		printf("%ld addresses agree with the reference\n", n);
+		return 0;
+	}
+	if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+		bench(argc >= 3 ? atoi(argv[2]) : 1000000);
+		return 0;
+	}
+	fprintf(stderr, "usage: %s check < addresses | bench [count]\n", argv[0]);
+	return 1;
+}
+
+#endif							/* EMAIL_FUZZ */
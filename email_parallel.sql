@@ -0,0 +1,84 @@
+---------------------------------------------------------------------------
+--
+-- email_parallel.sql-
+--    Brings a database set up with an older email.sql up to date, with
+--    the PARALLEL SAFE and LEAKPROOF markings email.source explains.
+--
+--    Needs PostgreSQL 9.6 or later, and a superuser for LEAKPROOF.
+--    Functions that the older email.sql did not have yet are skipped with
+--    a notice, and the script can be run again at any time.  A function
+--    whose name exists with another signature is an error, as that means
+--    the list below is out of step with email.source.
+--
+---------------------------------------------------------------------------
+
+\set ON_ERROR_STOP on
+
+DO $$
+DECLARE
+	f record;
+BEGIN
+	FOR f IN SELECT * FROM (VALUES
+		('email_in(cstring)', 'PARALLEL SAFE'),
+		('email_out(EmailAddress)', 'PARALLEL SAFE'),
+		('email_recv(internal)', 'PARALLEL SAFE'),
+		('email_send(EmailAddress)', 'PARALLEL SAFE'),
+		('email_typanalyze(internal)', 'PARALLEL SAFE'),
+		('email_upgrade(EmailAddress)', 'PARALLEL SAFE'),
+		('email_text(EmailAddress)', 'PARALLEL SAFE'),
+		('email_domain(EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_local(EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('try_email_in(text)', 'PARALLEL SAFE'),
+		('email_parse_array(text[])', 'PARALLEL SAFE'),
+		('email_is_valid(text)', 'PARALLEL SAFE'),
+		('email_validate(text)', 'PARALLEL SAFE'),
+		('email_lt(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_le(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_eq(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_ne(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_ge(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_gt(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_de_support(internal)', 'PARALLEL SAFE'),
+		('email_de(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_dne(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_de_sel(internal, oid, internal, int4)', 'PARALLEL SAFE'),
+		('email_dne_sel(internal, oid, internal, int4)', 'PARALLEL SAFE'),
+		('email_de_joinsel(internal, oid, internal, int2, internal)', 'PARALLEL SAFE'),
+		('email_dne_joinsel(internal, oid, internal, int2, internal)', 'PARALLEL SAFE'),
+		('email_cmp(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_sortsupport(internal)', 'PARALLEL SAFE'),
+		('email_hash(EmailAddress)', 'PARALLEL SAFE'),
+		('email_hash_extended(EmailAddress, int8)', 'PARALLEL SAFE'),
+		('email_reverse_domain(EmailAddress)', 'PARALLEL SAFE'),
+		('email_rdomain_lt(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_rdomain_le(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_rdomain_ge(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_rdomain_gt(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_rdomain_cmp(EmailAddress, EmailAddress)', 'PARALLEL SAFE LEAKPROOF'),
+		('email_within_support(internal)', 'PARALLEL SAFE'),
+		('email_within(EmailAddress, text)', 'PARALLEL SAFE'),
+		('email_starts_with(EmailAddress, text)', 'PARALLEL SAFE'),
+		('email_spg_config(internal, internal)', 'PARALLEL SAFE'),
+		('email_spg_choose(internal, internal)', 'PARALLEL SAFE'),
+		('email_spg_inner_consistent(internal, internal)', 'PARALLEL SAFE'),
+		('email_spg_leaf_consistent(internal, internal)', 'PARALLEL SAFE'),
+		('email_spg_compress(internal)', 'PARALLEL SAFE'),
+		('email_similarity(EmailAddress, text)', 'PARALLEL SAFE'),
+		('email_similar(EmailAddress, text)', 'PARALLEL SAFE'),
+		('email_contains(EmailAddress, text)', 'PARALLEL SAFE'),
+		('email_gin_extract_value(EmailAddress, internal)', 'PARALLEL SAFE'),
+		('email_gin_extract_query(text, internal, int2, internal, internal, internal, internal)', 'PARALLEL SAFE'),
+		('email_gin_consistent(internal, int2, text, int4, internal, internal, internal, internal)','PARALLEL SAFE')
+	) AS markings (signature, markings) LOOP
+		IF to_regprocedure(f.signature) IS NOT NULL THEN
+			EXECUTE format('ALTER FUNCTION %s %s',
+			               to_regprocedure(f.signature), f.markings);
+		ELSIF EXISTS (SELECT 1 FROM pg_proc
+		              WHERE proname = lower(split_part(f.signature, '(', 1))) THEN
+			RAISE EXCEPTION 'function % does not exist', f.signature;
+		ELSE
+			RAISE NOTICE 'skipping %, the older email.sql did not have it', f.signature;
+		END IF;
+	END LOOP;
+END;
+$$;